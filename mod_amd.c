@@ -10,14 +10,75 @@
  * that analyzes inbound audio and sets:
  *   - channel vars: amd_result, amd_cause, amd_result_epoch
  *   - fires a custom event subclass "amd" with AMD-Result / AMD-Cause
+ *
+ * Named parameter profiles can be declared in amd.conf and selected per
+ * call with profile=<name>; with profile_selection=ucb the module picks a
+ * profile itself and learns from amd_feedback which one decides fastest
+ * without being wrong.
  */
 
 #include <switch.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 
 #define AMD_PARAMS (2)
 #define AMD_SYNTAX "<uuid> <command>"
 
 #define BUG_AMD_NAME_READ "amd_read"
+#define BUG_AMD_NAME_PREROLL "amd_preroll"
+#define AMD_PREROLL_PRIVATE "_amd_preroll_"
+#define AMD_VAD_PRIVATE "_amd_vad_"
+#define AMD_EVENT_PROGRESS "amd::progress"
+#define AMD_EVENT_CORRECTION "amd::correction"
+#define AMD_EVENT_MONITOR "amd::monitor"
+#define AMD_EVENT_STATS "amd::stats"
+#define AMD_PREROLL_MAX_MS (10000)
+#define AMD_AEC_MAX_TAPS (2048)
+#define AMD_AEC_MAX_FRAME (SWITCH_RECOMMENDED_BUFFER_SIZE / 4)
+#define AMD_MAX_TIMELINE (16)           /* words kept per round for the timeline */
+#define AMD_CAPTURE_ALIGN (4096)        /* O_DIRECT buffer and length alignment */
+#define AMD_LOG_RECORD (2048)           /* one decision log line, newline included */
+#define AMD_LOG_BATCH (64 * 1024)
+#define AMD_STATS_SHARDS (64)           /* media threads hash onto these for metric updates */
+#define AMD_STATS_BUCKETS (128)         /* time-to-decision histogram, 100 ms per bucket */
+#define AMD_STATS_PACKET (1432)         /* largest StatsD datagram we send */
+#define AMD_RATE_NAME_LEN (64)
+#define AMD_RATE_COUNT_MAX (0xfff)      /* per-second count per result, saturating */
+#define AMD_OVERLOAD_TIERS (3)
+#define AMD_OVERLOAD_STRIDE (2)         /* frames per analysed frame at tier 2 */
+#define AMD_TONE_BINS (20)
+#define AMD_TONE_FRAMES (5)             /* steady tonal frames before early media counts as a tone */
+
+#define AMD_MAX_PROFILES (32)
+#define AMD_PROFILE_NAME_LEN (64)
+#define AMD_REWARD_SCALE (1000000)
+#define AMD_TRIE_FANOUT (12)        /* 0-9, '*', '#' */
+#define AMD_TRIE_MAX_NODES (32767)
+#define AMD_CACHE_KEY_LEN (24)
+#define AMD_CACHE_PROBE (8)
+#define AMD_CACHE_MAGIC (0x43444d41)  /* "AMDC" */
+#define AMD_EXT_SLOTS (4096)            /* concurrent calls streaming to the classifier */
+#define AMD_EXT_MAX_SAMPLES (960)       /* per AUDIO message: 20 ms at 48 kHz */
+#define AMD_EXT_BATCH (64 * 1024)
+
+/* External classifier wire message types */
+#define AMD_EXT_START (1)
+#define AMD_EXT_AUDIO (2)
+#define AMD_EXT_STOP (3)
+#define AMD_EXT_VERDICT (16)
+
+#define AMD_SHM_RING_FRAMES (64)        /* per-session audio ring depth */
+#define AMD_SHM_MAGIC (0x53444d41)      /* "AMDS" */
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_amd_load);
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_amd_shutdown);
@@ -25,6 +86,10 @@ SWITCH_MODULE_DEFINITION(mod_amd, mod_amd_load, mod_amd_shutdown, NULL);
 
 SWITCH_STANDARD_APP(amd_start_function);
 SWITCH_STANDARD_API(uuid_amd_detect_function);
+SWITCH_STANDARD_API(amd_feedback_function);
+SWITCH_STANDARD_API(amd_cache_function);
+SWITCH_STANDARD_API(amd_rates_function);
+SWITCH_STANDARD_API(amd_gateways_function);
 
 /* -------------------------
    Configurable parameters
@@ -40,10 +105,359 @@ typedef struct {
     uint32_t maximum_number_of_words;
     uint32_t maximum_word_length;
     uint32_t silence_threshold;
+    uint32_t cached_machine_analysis_time;  /* total_analysis_time cap when history says MACHINE */
+    uint32_t classifier_deadline;           /* ms to wait for the external classifier, 0 = not used */
+    uint32_t early_only;                    /* started before answer: give up with NOTSURE/ANSWERED at answer */
+    uint32_t talkover;                      /* ms of callee speech over our prompt that means HUMAN, 0 = off */
+    uint32_t aec_taps;                      /* echo canceller length in samples, 0 = off */
+    uint32_t dtmf;                          /* 1 = any received digit means HUMAN */
+    uint32_t progress_interval;             /* ms between amd::progress events, 0 = none */
+    uint32_t fast_verdict;                  /* ms after which a provisional verdict is announced, 0 = off */
+    uint32_t monitor;                       /* after the verdict, keep watching every Nth frame, 0 = off */
+    uint32_t rearm;                         /* extra detection rounds after the first verdict */
+    uint32_t cpu_budget_us;                 /* CPU time allowed per round, 0 = unlimited */
 } amd_params_t;
 
 static amd_params_t globals;
 
+/* -------------------------
+   Module state
+   ------------------------- */
+
+typedef struct {
+    char *name;
+    amd_params_t params;
+    int arm;                    /* index into amd.arms, -1 if not a bandit candidate */
+} amd_profile_t;
+
+/* Destination prefix trie node; children and profile are indices, 0 / -1 meaning none */
+typedef struct {
+    int16_t child[AMD_TRIE_FANOUT];
+    int16_t profile;
+} amd_trie_node_t;
+
+/* Immutable snapshot of the profile table, swapped as a whole on reload */
+typedef struct {
+    switch_memory_pool_t *pool;
+    amd_profile_t profiles[AMD_MAX_PROFILES];
+    uint32_t profile_count;
+    uint32_t bandit_candidates[AMD_MAX_PROFILES];
+    uint32_t bandit_count;
+    amd_trie_node_t *trie;      /* node 0 is the root */
+    uint32_t trie_nodes;
+} amd_config_t;
+
+/* Destination history entry; hash 0 marks an empty slot */
+typedef struct {
+    uint64_t hash;
+    char key[AMD_CACHE_KEY_LEN];
+    char result[8];
+    char cause[24];
+    uint32_t stored;            /* epoch seconds of the last decision */
+    uint32_t used;              /* epoch seconds of the last lookup or store, for LRU */
+    uint32_t count;             /* decisions recorded for this destination */
+} amd_cache_entry_t;
+
+typedef struct {
+    switch_mutex_t *mutex;
+    amd_cache_entry_t *slots;
+} amd_cache_shard_t;
+
+/* Shared-memory slot: seq is even when stable and odd while a writer owns it */
+typedef struct {
+    atomic_uint_fast32_t seq;
+    amd_cache_entry_t entry;
+} amd_shm_slot_t;
+
+/* Shared-memory segment header, followed by the slots. ready is set last by the creator. */
+typedef struct {
+    atomic_uint_fast32_t ready;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slots;
+    atomic_uint_fast64_t stores;
+    atomic_uint_fast64_t evictions;
+    amd_shm_slot_t slot[];
+} amd_shm_cache_t;
+
+/* Bounded lock-free multi-producer / single-consumer queue of fixed-size cells */
+typedef struct {
+    uint8_t *cells;
+    size_t cell_size;
+    size_t mask;
+    atomic_size_t head;         /* next position producers claim */
+    size_t tail;                /* consumer position */
+} amd_ring_t;
+
+typedef struct {
+    atomic_size_t seq;
+} amd_ring_cell_t;
+
+/* Queued message for the external classifier writer */
+typedef struct {
+    uint32_t call_id;
+    uint16_t type;
+    uint16_t samples;
+    uint32_t rate;
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    int16_t data[AMD_EXT_MAX_SAMPLES];
+} amd_ext_msg_t;
+
+/* Per-call verdict mailbox, owned by call_id while the call streams */
+typedef struct {
+    atomic_uint_fast32_t call_id;
+    atomic_uint_fast32_t verdict;       /* call_id the result belongs to; stored last */
+    char result[8];
+    char cause[24];
+} amd_ext_slot_t;
+
+/* Shared-memory audio arena for co-located analysers. One session per call:
+ * mod_amd produces frames at head, the analyser consumes at tail and posts a
+ * verdict tagged with the session generation. */
+typedef struct {
+    uint32_t samples;
+    uint32_t reserved;
+    int16_t data[AMD_EXT_MAX_SAMPLES];
+} amd_shm_frame_t;
+
+typedef struct {
+    atomic_uint_fast32_t generation;    /* odd while a call owns the session */
+    uint32_t rate;
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+    atomic_uint_fast32_t verdict;       /* generation the result belongs to; stored last */
+    char result[8];
+    char cause[24];
+    amd_shm_frame_t frames[AMD_SHM_RING_FRAMES];
+} amd_shm_session_t;
+
+typedef struct {
+    atomic_uint_fast32_t magic;         /* AMD_SHM_MAGIC once the header is complete */
+    uint32_t version;
+    uint32_t sessions;
+    uint32_t ring_frames;
+    uint32_t frame_samples;
+    uint32_t session_size;
+    int32_t pid;                        /* producer process and its eventfd, for pidfd_getfd(); see audio_shm_socket */
+    int32_t eventfd;
+    atomic_uint_fast32_t sleeping;      /* analyser sets this before blocking on the eventfd */
+    atomic_uint_fast64_t dropped;
+    amd_shm_session_t session[];
+} amd_shm_arena_t;
+
+/*
+ * A sampled call's capture ring, malloc'd at start. The call fills pcm as a
+ * ring of size samples; a selected verdict hands the whole block to the
+ * writer, which frees it. Unselected calls free it at close.
+ */
+typedef struct {
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    char result[8];
+    char cause[24];
+    uint32_t round;
+    uint32_t rate;
+    uint32_t size;              /* ring capacity in samples */
+    uint32_t samples;           /* audio in the ring, set on submit */
+    uint32_t first;             /* index of the oldest sample, set on submit */
+    int16_t pcm[];
+} amd_capture_t;
+
+/* One decision log line, formatted by the call thread straight into a queue cell */
+typedef struct {
+    uint32_t len;
+    char line[AMD_LOG_RECORD];
+} amd_log_record_t;
+
+/* Metric totals; causes outside amd_stats_causes count as OTHER */
+#define AMD_STATS_RESULTS (3)
+#define AMD_STATS_CAUSES (13)
+
+typedef struct {
+    uint64_t decisions[AMD_STATS_RESULTS][AMD_STATS_CAUSES];
+    uint64_t decision_ms[AMD_STATS_BUCKETS];
+    uint64_t started;
+    uint64_t stopped;
+    uint64_t frames;
+    uint64_t cpu_ns;
+    uint64_t overload_transitions;
+    uint32_t overload_tier;
+    uint64_t rates_full;
+    uint64_t admission_unchecked;
+    uint32_t lite_sessions;
+} amd_stats_t;
+
+/* One shard per group of media threads, cache-line aligned so threads do not share lines */
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t decisions[AMD_STATS_RESULTS][AMD_STATS_CAUSES];
+    atomic_uint_fast64_t decision_ms[AMD_STATS_BUCKETS];
+    atomic_uint_fast64_t started;
+    atomic_uint_fast64_t stopped;
+    atomic_uint_fast64_t frames;
+    atomic_uint_fast64_t cpu_ns;
+} amd_stats_shard_t;
+
+/*
+ * Campaign or gateway with a per-second window; hash 0 marks a free slot,
+ * AMD_RATE_FREED an evicted one and AMD_RATE_BUSY one being claimed or evicted.
+ * Each second is one 64-bit word: 28-bit stamp, then 12-bit MACHINE,
+ * HUMAN and NOTSURE counts, so a bucket is reused with a single CAS.
+ */
+typedef struct {
+    atomic_uint_fast64_t hash;
+    atomic_int ready;           /* name is valid */
+    atomic_uint refs;           /* AMD sessions holding the key; it is never evicted while set */
+    atomic_uint last;           /* amd_rates_now() of the last claim or verdict */
+    char kind;                  /* 'c'ampaign or 'g'ateway */
+    char name[AMD_RATE_NAME_LEN];
+    atomic_uint_fast64_t *buckets;      /* NULL when rates_window is 0 */
+    atomic_uint active;                 /* admitted AMD sessions, campaigns only */
+
+    /* Audio quality since load, gateways only */
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t noaudio;
+    atomic_uint_fast64_t notsure;
+    atomic_uint_fast64_t toolong;
+    atomic_uint_fast64_t noise_sum;     /* sum of per-call noise floors */
+    atomic_uint_fast64_t noise_calls;
+    atomic_uint_fast64_t decision_ms[AMD_STATS_BUCKETS];
+} amd_rate_key_t;
+
+/* admission_fallback, resolved by do_config */
+typedef enum {
+    AMD_FALLBACK_REFUSE,
+    AMD_FALLBACK_LITE
+} amd_fallback_t;
+
+/* Overload thresholds for tiers 1..count, parsed from a "t1,t2,t3" setting */
+typedef struct {
+    atomic_uint count;
+    atomic_uint at[AMD_OVERLOAD_TIERS];
+} amd_overload_th_t;
+
+/* Bandit arm; survives reloads and is matched to profiles by name */
+typedef struct {
+    char name[AMD_PROFILE_NAME_LEN];
+    atomic_uint_fast64_t pulls;
+    atomic_uint_fast64_t trials;
+    atomic_uint_fast64_t reward;    /* sum of rewards in AMD_REWARD_SCALE units */
+} amd_arm_t;
+
+static struct {
+    switch_memory_pool_t *pool;
+    switch_thread_rwlock_t *config_lock;
+    switch_event_node_t *reload_node;
+    switch_thread_t *housekeeping_thread;
+    atomic_int running;
+
+    amd_config_t *config;
+
+    amd_arm_t arms[AMD_MAX_PROFILES];
+    uint32_t arm_count;
+
+    char *prefix_variable;
+    char *campaign_variable;
+    char *early_media_profile;
+
+    /* non-reloadable module settings */
+    char *profile_selection;
+    char *bandit_profiles;
+    char *bandit_state_file;
+    uint32_t bandit_time_weight;
+    uint32_t bandit_snapshot_interval;
+
+    amd_cache_shard_t *cache_shards;
+    uint32_t cache_shard_slots;
+    amd_shm_cache_t *cache_shm;
+    switch_size_t cache_shm_size;
+    switch_bool_t cache_shm_created;
+    atomic_uint_fast64_t cache_hits;
+    atomic_uint_fast64_t cache_misses;
+    atomic_uint_fast64_t cache_stores;
+    atomic_uint_fast64_t cache_evictions;
+    uint32_t cache_entries;
+    uint32_t cache_shard_count;
+    uint32_t cache_ttl;
+    char *cache_snapshot_file;
+    uint32_t cache_snapshot_interval;
+    char *cache_shm_name;
+
+    char *classifier_endpoint;
+    uint32_t classifier_queue;
+    switch_thread_t *classifier_thread;
+    amd_ring_t classifier_ring;
+    amd_ext_slot_t *classifier_slots;
+    atomic_uint_fast32_t classifier_next_id;
+    atomic_int classifier_connected;
+    atomic_uint_fast64_t classifier_sent;
+    atomic_uint_fast64_t classifier_dropped;
+    atomic_uint_fast64_t classifier_verdicts;
+
+    char *audio_shm_name;
+    uint32_t audio_shm_sessions;
+    amd_shm_arena_t *audio_shm;
+    switch_size_t audio_shm_size;
+    int audio_shm_efd;
+    atomic_uint_fast32_t audio_shm_next;
+    atomic_int *audio_shm_owned;        /* per session, claimed here before the generation is published */
+    char *audio_shm_socket;
+    int audio_shm_listen;
+    switch_thread_t *audio_shm_thread;
+
+    char *capture_dir;
+    char *capture_results;
+    uint32_t capture_rate;
+    uint32_t capture_seconds;
+    uint32_t capture_queue;
+    amd_ring_t capture_ring;
+    switch_thread_t *capture_thread;
+    atomic_uint_fast64_t capture_written;
+    atomic_uint_fast64_t capture_dropped;
+
+    char *decision_log;
+    uint32_t decision_log_max_size;
+    uint32_t decision_log_files;
+    uint32_t decision_log_queue;
+    amd_ring_t log_ring;
+    switch_thread_t *log_thread;
+    atomic_uint_fast64_t log_written;
+    atomic_uint_fast64_t log_dropped;
+
+    char *statsd_endpoint;
+    char *statsd_format;
+    char *statsd_prefix;
+    char *statsd_tags;
+    uint32_t statsd_interval;
+    uint32_t stats_interval;
+    switch_thread_t *stats_thread;
+    atomic_uint_fast32_t stats_next_shard;
+    amd_stats_shard_t stats[AMD_STATS_SHARDS];
+
+    uint32_t rates_window;
+    uint32_t rates_keys;
+    uint32_t noaudio_threshold;
+
+    char *overload_idle;
+    char *overload_frame_ns;
+    uint32_t overload_dwell;
+    amd_overload_th_t overload_idle_th;         /* parsed by do_config, read by the stats thread */
+    amd_overload_th_t overload_ns_th;
+    atomic_uint overload_tier;
+    atomic_uint_fast64_t overload_transitions;
+    amd_rate_key_t *rate_keys;
+    atomic_uint_fast64_t rates_full;
+    atomic_uint_fast64_t rates_evicted;
+
+    uint32_t max_sessions;
+    uint32_t campaign_max_sessions;
+    uint32_t lite_max_sessions;
+    char *admission_fallback;
+    amd_fallback_t fallback;
+    atomic_uint active_sessions;
+    atomic_uint lite_sessions;
+    atomic_uint_fast64_t admission_unchecked;   /* campaign quotas skipped for want of a rates key */
+} amd;
+
 static switch_xml_config_item_t instructions[] = {
     SWITCH_CONFIG_ITEM(
         "initial_silence",
@@ -90,210 +504,4672 @@ static switch_xml_config_item_t instructions[] = {
         SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
         &globals.silence_threshold, (void*)256, NULL, NULL, NULL),
 
+    SWITCH_CONFIG_ITEM(
+        "cached_machine_analysis_time",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.cached_machine_analysis_time, (void*)0, NULL, "ms", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "classifier_deadline",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.classifier_deadline, (void*)0, NULL, "ms", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "early_only",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.early_only, (void*)0, NULL, "0|1", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "talkover",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.talkover, (void*)0, NULL, "ms", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "aec_taps",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.aec_taps, (void*)0, NULL, "samples", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "dtmf",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.dtmf, (void*)0, NULL, "0|1", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "progress_interval",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.progress_interval, (void*)0, NULL, "ms", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "fast_verdict",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.fast_verdict, (void*)0, NULL, "ms", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "monitor",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.monitor, (void*)0, NULL, "frame decimation", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "rearm",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.rearm, (void*)0, NULL, "rounds", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "cpu_budget_us",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &globals.cpu_budget_us, (void*)0, NULL, "us", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "prefix_variable",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.prefix_variable, "", NULL, "channel variable", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "campaign_variable",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.campaign_variable, "amd_campaign", NULL, "channel variable", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "early_media_profile",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.early_media_profile, "", NULL, "profile name", NULL),
+
+    /* Profile self-tuning (module settings, read once at load) */
+    SWITCH_CONFIG_ITEM(
+        "profile_selection",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.profile_selection, "none", NULL, "none|ucb", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "bandit_profiles",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.bandit_profiles, "", NULL, "name,name,...", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "bandit_time_weight",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.bandit_time_weight, (void*)30, NULL, "0-100", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "bandit_state_file",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.bandit_state_file, "", NULL, "path", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "bandit_snapshot_interval",
+        SWITCH_CONFIG_INT, 0,
+        &amd.bandit_snapshot_interval, (void*)60, NULL, "seconds", NULL),
+
+    /* Destination result cache (module settings, read once at load) */
+    SWITCH_CONFIG_ITEM(
+        "cache_entries",
+        SWITCH_CONFIG_INT, 0,
+        &amd.cache_entries, (void*)0, NULL, "entries, 0 disables", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "cache_shards",
+        SWITCH_CONFIG_INT, 0,
+        &amd.cache_shard_count, (void*)16, NULL, NULL, NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "cache_ttl",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.cache_ttl, (void*)604800, NULL, "seconds", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "cache_snapshot_file",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.cache_snapshot_file, "", NULL, "path", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "cache_snapshot_interval",
+        SWITCH_CONFIG_INT, 0,
+        &amd.cache_snapshot_interval, (void*)300, NULL, "seconds", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "cache_shm_name",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.cache_shm_name, "", NULL, "/name", NULL),
+
+    /* External classifier (module settings, read once at load) */
+    SWITCH_CONFIG_ITEM(
+        "classifier_endpoint",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.classifier_endpoint, "", NULL, "unix:/path|tcp:host:port", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "classifier_queue",
+        SWITCH_CONFIG_INT, 0,
+        &amd.classifier_queue, (void*)2048, NULL, "messages", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "audio_shm_name",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.audio_shm_name, "", NULL, "/name", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "audio_shm_sessions",
+        SWITCH_CONFIG_INT, 0,
+        &amd.audio_shm_sessions, (void*)256, NULL, "concurrent calls", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "audio_shm_socket",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.audio_shm_socket, "", NULL, "/path", NULL),
+
+    /* Selective audio capture */
+    SWITCH_CONFIG_ITEM(
+        "capture_dir",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.capture_dir, "", NULL, "directory", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "capture_results",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.capture_results, "MACHINE,NOTSURE", NULL, "RESULT,RESULT,...", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "capture_rate",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.capture_rate, (void*)100, NULL, "percent", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "capture_seconds",
+        SWITCH_CONFIG_INT, 0,
+        &amd.capture_seconds, (void*)10, NULL, "seconds", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "capture_queue",
+        SWITCH_CONFIG_INT, 0,
+        &amd.capture_queue, (void*)64, NULL, "calls", NULL),
+
+    /* Decision log */
+    SWITCH_CONFIG_ITEM(
+        "decision_log",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.decision_log, "", NULL, "/path/file", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "decision_log_max_size",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.decision_log_max_size, (void*)100, NULL, "MB", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "decision_log_files",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.decision_log_files, (void*)5, NULL, "rotated files kept", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "decision_log_queue",
+        SWITCH_CONFIG_INT, 0,
+        &amd.decision_log_queue, (void*)4096, NULL, "records", NULL),
+
+    /* StatsD metrics */
+    SWITCH_CONFIG_ITEM(
+        "statsd_endpoint",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.statsd_endpoint, "", NULL, "host:port", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "statsd_format",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.statsd_format, "statsd", NULL, "statsd|dogstatsd", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "statsd_prefix",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.statsd_prefix, "amd", NULL, "metric prefix", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "statsd_tags",
+        SWITCH_CONFIG_STRING, 0,
+        &amd.statsd_tags, "", NULL, "tag:value,...", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "statsd_interval",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.statsd_interval, (void*)10, NULL, "seconds", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "stats_interval",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.stats_interval, (void*)0, NULL, "seconds", NULL),
+
+    /* Campaign and gateway rates */
+    SWITCH_CONFIG_ITEM(
+        "rates_window",
+        SWITCH_CONFIG_INT, 0,
+        &amd.rates_window, (void*)900, NULL, "seconds", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "rates_keys",
+        SWITCH_CONFIG_INT, 0,
+        &amd.rates_keys, (void*)256, NULL, "campaigns + gateways", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "noaudio_threshold",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.noaudio_threshold, (void*)16, NULL, "amplitude", NULL),
+
+    /* Overload tiers */
+    SWITCH_CONFIG_ITEM(
+        "overload_idle",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.overload_idle, "", NULL, "tier1,tier2,tier3 idle %", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "overload_frame_ns",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.overload_frame_ns, "", NULL, "tier1,tier2,tier3 ns", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "overload_dwell",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.overload_dwell, (void*)30, NULL, "seconds", NULL),
+
+    /* Admission control */
+    SWITCH_CONFIG_ITEM(
+        "max_sessions",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.max_sessions, (void*)0, NULL, "sessions", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "campaign_max_sessions",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.campaign_max_sessions, (void*)0, NULL, "sessions", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "admission_fallback",
+        SWITCH_CONFIG_STRING, CONFIG_RELOADABLE,
+        &amd.admission_fallback, "refuse", NULL, "refuse|lite", NULL),
+
+    SWITCH_CONFIG_ITEM(
+        "lite_max_sessions",
+        SWITCH_CONFIG_INT, CONFIG_RELOADABLE,
+        &amd.lite_max_sessions, (void*)32, NULL, "sessions", NULL),
+
     SWITCH_CONFIG_ITEM_END()
 };
 
-static switch_status_t do_config(switch_bool_t reload)
+/* Apply a single key=value to a parameter set.
+ * Returns SWITCH_STATUS_FALSE for a bad value, SWITCH_STATUS_NOTFOUND for an unknown key. */
+static switch_status_t amd_params_set(amd_params_t *params, const char *key, const char *val)
 {
-    memset(&globals, 0, sizeof(globals));
-    if (switch_xml_config_parse_module_settings("amd.conf", reload, instructions) != SWITCH_STATUS_SUCCESS) {
+    int value = atoi(val);
+
+    if (value <= 0) {
         return SWITCH_STATUS_FALSE;
     }
-    return SWITCH_STATUS_SUCCESS;
-}
-
-/* -------------------------
-   VAD state and classifier
-   ------------------------- */
 
-typedef enum {
-    SILENCE,
-    VOICED
-} amd_frame_classifier;
+    if (!strcasecmp(key, "initial_silence"))               params->initial_silence = value;
+    else if (!strcasecmp(key, "greeting"))                 params->greeting = value;
+    else if (!strcasecmp(key, "after_greeting_silence"))   params->after_greeting_silence = value;
+    else if (!strcasecmp(key, "total_analysis_time"))      params->total_analysis_time = value;
+    else if (!strcasecmp(key, "min_word_length"))          params->minimum_word_length = value;
+    else if (!strcasecmp(key, "between_words_silence"))    params->between_words_silence = value;
+    else if (!strcasecmp(key, "maximum_number_of_words"))  params->maximum_number_of_words = value;
+    else if (!strcasecmp(key, "maximum_word_length"))      params->maximum_word_length = value;
+    else if (!strcasecmp(key, "silence_threshold"))        params->silence_threshold = value;
+    else if (!strcasecmp(key, "cached_machine_analysis_time")) params->cached_machine_analysis_time = value;
+    else if (!strcasecmp(key, "classifier_deadline"))      params->classifier_deadline = value;
+    else if (!strcasecmp(key, "early_only"))               params->early_only = value;
+    else if (!strcasecmp(key, "talkover"))                 params->talkover = value;
+    else if (!strcasecmp(key, "aec_taps"))                 params->aec_taps = value;
+    else if (!strcasecmp(key, "dtmf"))                     params->dtmf = value;
+    else if (!strcasecmp(key, "progress_interval"))        params->progress_interval = value;
+    else if (!strcasecmp(key, "fast_verdict"))             params->fast_verdict = value;
+    else if (!strcasecmp(key, "monitor"))                  params->monitor = value;
+    else if (!strcasecmp(key, "rearm"))                    params->rearm = value;
+    else if (!strcasecmp(key, "cpu_budget_us"))            params->cpu_budget_us = value;
+    else return SWITCH_STATUS_NOTFOUND;
 
-typedef enum {
-    VAD_STATE_IN_WORD,
-    VAD_STATE_IN_SILENCE,
-} amd_vad_state_t;
+    return SWITCH_STATUS_SUCCESS;
+}
 
-typedef struct amd_vad_c {
-    switch_core_session_t *session;
-    switch_channel_t *channel;
-    switch_codec_implementation_t read_impl;
+/* Find (or register) the bandit arm for a profile name. Caller holds the config write lock. */
+static int amd_arm_lookup(const char *name, switch_bool_t create)
+{
+    uint32_t i;
 
-    amd_vad_state_t state;
-    amd_params_t params;
-    uint32_t frame_ms;
-    int32_t sample_count_limit;
+    for (i = 0; i < amd.arm_count; i++) {
+        if (!strcasecmp(amd.arms[i].name, name)) {
+            return (int)i;
+        }
+    }
 
-    uint32_t silence_duration;
-    uint32_t voice_duration;
-    uint32_t words;
+    if (!create || amd.arm_count >= AMD_MAX_PROFILES) {
+        return -1;
+    }
 
-    uint32_t in_initial_silence:1;
-    uint32_t in_greeting:1;
-} amd_vad_t;
+    switch_copy_string(amd.arms[amd.arm_count].name, name, sizeof(amd.arms[0].name));
+    atomic_init(&amd.arms[amd.arm_count].pulls, 0);
+    atomic_init(&amd.arms[amd.arm_count].trials, 0);
+    atomic_init(&amd.arms[amd.arm_count].reward, 0);
+    return (int)amd.arm_count++;
+}
 
-/* Fire a custom event and queue a clone to the session */
-static void amd_fire_event(const char *result, const char *cause, switch_core_session_t *fs_s)
+static amd_profile_t *amd_profile_find(amd_config_t *cfg, const char *name)
 {
-    switch_event_t *event = NULL;
-    switch_event_t *event_copy = NULL;
+    uint32_t i;
 
-    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "amd") != SWITCH_STATUS_SUCCESS) {
-        return;
+    if (!cfg || zstr(name)) {
+        return NULL;
     }
 
-    /* AMD result/cause */
-    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Result", result);
-    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Cause", cause);
+    for (i = 0; i < cfg->profile_count; i++) {
+        if (!strcasecmp(cfg->profiles[i].name, name)) {
+            return &cfg->profiles[i];
+        }
+    }
 
-    /* Include channel identifiers */
-    if (fs_s) {
-        const char *uuid = switch_core_session_get_uuid(fs_s);
-        if (uuid) {
-            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", uuid);
-            /* If you also want an alias, uncomment:
-               switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-Unique-ID", uuid);
-            */
+    return NULL;
+}
+
+static int amd_trie_index(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c == '*') return 10;
+    if (c == '#') return 11;
+    return -1;
+}
+
+/*
+ * Insert a prefix; the trie array was sized for every prefix digit up front.
+ * Returns SWITCH_FALSE, inserting nothing, if it has no digit, '*' or '#'.
+ */
+static switch_bool_t amd_trie_insert(amd_config_t *cfg, const char *digits, int16_t profile)
+{
+    uint32_t node = 0;
+
+    for (; *digits; digits++) {
+        int c = amd_trie_index(*digits);
+
+        if (c < 0) {
+            continue;
         }
-        /* Optional, handy for debugging */
-        {
-            switch_channel_t *ch = switch_core_session_get_channel(fs_s);
-            if (ch) {
-                const char *ch_name = switch_channel_get_name(ch);
-                if (ch_name) {
-                    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-Name", ch_name);
+
+        if (!cfg->trie[node].child[c]) {
+            uint32_t next = cfg->trie_nodes++;
+
+            memset(&cfg->trie[next], 0, sizeof(cfg->trie[next]));
+            cfg->trie[next].profile = -1;
+            cfg->trie[node].child[c] = (int16_t)next;
+        }
+        node = (uint32_t)cfg->trie[node].child[c];
+    }
+
+    /* The root stands for the empty prefix, which lookups never match */
+    if (!node) {
+        return SWITCH_FALSE;
+    }
+    cfg->trie[node].profile = profile;
+
+    return SWITCH_TRUE;
+}
+
+/* Longest matching prefix, O(digits) and allocation-free. Non-dialable characters are skipped. */
+static amd_profile_t *amd_trie_lookup(amd_config_t *cfg, const char *number)
+{
+    int16_t match = -1;
+    uint32_t node = 0;
+
+    if (!cfg || !cfg->trie || zstr(number)) {
+        return NULL;
+    }
+
+    for (; *number; number++) {
+        int c = amd_trie_index(*number);
+
+        if (c < 0) {
+            continue;
+        }
+        if (!(node = (uint32_t)cfg->trie[node].child[c])) {
+            break;
+        }
+        if (cfg->trie[node].profile >= 0) {
+            match = cfg->trie[node].profile;
+        }
+    }
+
+    return match >= 0 ? &cfg->profiles[match] : NULL;
+}
+
+/* Build the trie from <prefixes><prefix digits="..." profile="..."/></prefixes> */
+static void amd_config_load_prefixes(amd_config_t *cfg, switch_xml_t x_prefixes)
+{
+    switch_xml_t x_prefix;
+    uint32_t max_nodes = 1;
+
+    for (x_prefix = switch_xml_child(x_prefixes, "prefix"); x_prefix; x_prefix = x_prefix->next) {
+        max_nodes += (uint32_t)strlen(switch_xml_attr_soft(x_prefix, "digits"));
+    }
+
+    if (max_nodes > AMD_TRIE_MAX_NODES) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,
+                          "AMD: Prefix table too large (%u nodes, max %u); prefixes disabled\n", max_nodes, AMD_TRIE_MAX_NODES);
+        return;
+    }
+
+    cfg->trie = switch_core_alloc(cfg->pool, sizeof(amd_trie_node_t) * max_nodes);
+    cfg->trie[0].profile = -1;
+    cfg->trie_nodes = 1;
+
+    for (x_prefix = switch_xml_child(x_prefixes, "prefix"); x_prefix; x_prefix = x_prefix->next) {
+        const char *digits = switch_xml_attr_soft(x_prefix, "digits");
+        const char *name = switch_xml_attr_soft(x_prefix, "profile");
+        amd_profile_t *profile = amd_profile_find(cfg, name);
+
+        if (!profile) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                              "AMD: Ignoring prefix [%s]: unknown profile [%s]\n", digits, name);
+            continue;
+        }
+
+        if (!amd_trie_insert(cfg, digits, (int16_t)(profile - cfg->profiles))) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                              "AMD: Ignoring prefix [%s] for profile [%s]: no digits, '*' or '#'\n", digits, name);
+        }
+    }
+}
+
+/* Build a new profile table from the <profiles> section of amd.conf */
+static amd_config_t *amd_config_load(void)
+{
+    switch_memory_pool_t *pool = NULL;
+    amd_config_t *cfg = NULL;
+    switch_xml_t xml = NULL, x_cfg = NULL, x_profiles, x_profile, x_param;
+
+    if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+        return NULL;
+    }
+
+    cfg = switch_core_alloc(pool, sizeof(*cfg));
+    cfg->pool = pool;
+
+    if (!(xml = switch_xml_open_cfg("amd.conf", &x_cfg, NULL))) {
+        return cfg;
+    }
+
+    if ((x_profiles = switch_xml_child(x_cfg, "profiles"))) {
+        for (x_profile = switch_xml_child(x_profiles, "profile"); x_profile; x_profile = x_profile->next) {
+            const char *name = switch_xml_attr_soft(x_profile, "name");
+            amd_profile_t *profile;
+
+            if (zstr(name) || amd_profile_find(cfg, name)) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                                  "AMD: Ignoring unnamed or duplicate profile [%s]\n", name);
+                continue;
+            }
+
+            if (cfg->profile_count >= AMD_MAX_PROFILES) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                                  "AMD: Too many profiles; ignoring [%s]\n", name);
+                break;
+            }
+
+            profile = &cfg->profiles[cfg->profile_count++];
+            profile->name = switch_core_strdup(pool, name);
+            profile->params = globals;
+            profile->arm = -1;
+
+            for (x_param = switch_xml_child(x_profile, "param"); x_param; x_param = x_param->next) {
+                const char *var = switch_xml_attr_soft(x_param, "name");
+                const char *val = switch_xml_attr_soft(x_param, "value");
+
+                if (amd_params_set(&profile->params, var, val) != SWITCH_STATUS_SUCCESS) {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                                      "AMD: Profile [%s]: invalid [%s]=[%s]\n", name, var, val);
                 }
             }
         }
     }
 
-    if (switch_event_dup(&event_copy, event) != SWITCH_STATUS_SUCCESS) {
-        switch_event_destroy(&event);
+    if ((x_profiles = switch_xml_child(x_cfg, "prefixes"))) {
+        amd_config_load_prefixes(cfg, x_profiles);
+    }
+
+    switch_xml_free(xml);
+    return cfg;
+}
+
+/* Mark the profiles listed in bandit_profiles as candidates. Caller holds the config write lock. */
+static void amd_config_bind_arms(amd_config_t *cfg)
+{
+    char *dup, *argv[AMD_MAX_PROFILES] = { 0 };
+    int argc, x;
+
+    if (zstr(amd.bandit_profiles)) {
         return;
     }
 
-    /* Queue to the session and fire globally */
-    switch_core_session_queue_event(fs_s, &event);
-    switch_event_fire(&event_copy);
+    dup = switch_core_strdup(cfg->pool, amd.bandit_profiles);
+    argc = switch_separate_string(dup, ',', argv, (int)switch_arraylen(argv));
+
+    for (x = 0; x < argc; x++) {
+        amd_profile_t *profile = amd_profile_find(cfg, argv[x]);
+
+        if (!profile) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                              "AMD: bandit_profiles names unknown profile [%s]\n", argv[x]);
+            continue;
+        }
+
+        if (profile->arm >= 0 || (profile->arm = amd_arm_lookup(profile->name, SWITCH_TRUE)) < 0) {
+            continue;
+        }
+
+        cfg->bandit_candidates[cfg->bandit_count++] = (uint32_t)(profile - cfg->profiles);
+    }
+}
+
+/* Parse an overload_* list into numbers for the stats thread. Caller holds the config write lock. */
+static void amd_overload_parse(const char *name, const char *list, amd_overload_th_t *th)
+{
+    unsigned at[AMD_OVERLOAD_TIERS];
+    int n = 0, i;
+
+    if (!zstr(list) && (n = sscanf(list, "%u,%u,%u", &at[0], &at[1], &at[2])) <= 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Ignoring %s [%s]; expected tier1,tier2,tier3\n", name, list);
+        n = 0;
+    }
+    for (i = 0; i < n; i++) {
+        atomic_store_explicit(&th->at[i], at[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&th->count, (unsigned)n, memory_order_release);
+}
+
+static switch_status_t do_config(switch_bool_t reload)
+{
+    amd_config_t *cfg, *old;
+
+    switch_thread_rwlock_wrlock(amd.config_lock);
+
+    memset(&globals, 0, sizeof(globals));
+    if (switch_xml_config_parse_module_settings("amd.conf", reload, instructions) != SWITCH_STATUS_SUCCESS) {
+        switch_thread_rwlock_unlock(amd.config_lock);
+        return SWITCH_STATUS_FALSE;
+    }
+    amd_overload_parse("overload_idle", amd.overload_idle, &amd.overload_idle_th);
+    amd_overload_parse("overload_frame_ns", amd.overload_frame_ns, &amd.overload_ns_th);
+    if (!strcasecmp(amd.admission_fallback, "lite")) {
+        amd.fallback = AMD_FALLBACK_LITE;
+    } else {
+        if (strcasecmp(amd.admission_fallback, "refuse")) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                              "AMD: Unknown admission_fallback [%s]; using refuse\n", amd.admission_fallback);
+        }
+        amd.fallback = AMD_FALLBACK_REFUSE;
+    }
+
+    if ((cfg = amd_config_load())) {
+        amd_config_bind_arms(cfg);
+        old = amd.config;
+        amd.config = cfg;
+        if (old) {
+            switch_core_destroy_memory_pool(&old->pool);
+        }
+    }
+
+    switch_thread_rwlock_unlock(amd.config_lock);
+
+    if (cfg) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,
+                          "AMD: Loaded %u profile(s), %u bandit candidate(s), %u prefix node(s)\n",
+                          cfg->profile_count, cfg->bandit_count, cfg->trie_nodes);
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static void amd_reload_event_handler(switch_event_t *event)
+{
+    (void)event;
+    do_config(SWITCH_TRUE);
 }
 
+/* -------------------------
+   Profile self-tuning (UCB1 bandit)
+   ------------------------- */
 
-static amd_frame_classifier classify_frame(uint32_t silence_threshold, const switch_frame_t *f, const switch_codec_implementation_t *codec)
+/* Pick a candidate profile. Caller holds the config read lock. */
+static amd_profile_t *amd_bandit_select(amd_config_t *cfg)
 {
-    (void)codec;
-    int16_t *audio = (int16_t *)f->data;
-    uint32_t score = 0, count = 0, j = 0;
-    double energy = 0.0;
+    amd_profile_t *best = NULL;
+    double best_score = -1.0;
+    uint64_t total = 0, fewest_pulls = UINT64_MAX;
+    uint32_t i;
+
+    if (!cfg->bandit_count) {
+        return NULL;
+    }
+
+    for (i = 0; i < cfg->bandit_count; i++) {
+        amd_arm_t *arm = &amd.arms[cfg->profiles[cfg->bandit_candidates[i]].arm];
+        total += atomic_load_explicit(&arm->trials, memory_order_relaxed);
+    }
+
+    for (i = 0; i < cfg->bandit_count; i++) {
+        amd_profile_t *profile = &cfg->profiles[cfg->bandit_candidates[i]];
+        amd_arm_t *arm = &amd.arms[profile->arm];
+        uint64_t n = atomic_load_explicit(&arm->trials, memory_order_relaxed);
+        uint64_t pulls = atomic_load_explicit(&arm->pulls, memory_order_relaxed);
+        double score;
+
+        /* Arms without feedback yet are explored first, spreading calls between them */
+        if (!n) {
+            if (best_score < INFINITY || pulls < fewest_pulls) {
+                best = profile;
+                best_score = INFINITY;
+                fewest_pulls = pulls;
+            }
+            continue;
+        }
+
+        score = (double)atomic_load_explicit(&arm->reward, memory_order_relaxed) / AMD_REWARD_SCALE / (double)n
+            + sqrt(2.0 * log((double)total) / (double)n);
+
+        if (score > best_score) {
+            best = profile;
+            best_score = score;
+        }
+    }
+
+    if (best) {
+        atomic_fetch_add_explicit(&amd.arms[best->arm].pulls, 1, memory_order_relaxed);
+    }
+
+    return best;
+}
+
+/* Reward combines correctness with how much of the analysis window the decision used */
+static void amd_bandit_feedback(amd_profile_t *profile, switch_bool_t correct, uint32_t decision_ms)
+{
+    amd_arm_t *arm = &amd.arms[profile->arm];
+    uint64_t reward = 0;
+
+    if (correct) {
+        uint32_t window = profile->params.total_analysis_time ? profile->params.total_analysis_time : 1;
+        uint32_t weight = amd.bandit_time_weight > 100 ? 100 : amd.bandit_time_weight;
+        uint64_t used = decision_ms > window ? window : decision_ms;
+
+        reward = AMD_REWARD_SCALE - ((uint64_t)AMD_REWARD_SCALE * weight / 100) * used / window;
+    }
+
+    atomic_fetch_add_explicit(&arm->reward, reward, memory_order_relaxed);
+    atomic_fetch_add_explicit(&arm->trials, 1, memory_order_relaxed);
+}
+
+static void amd_bandit_save(void)
+{
+    char tmp[1024];
+    FILE *fp;
+    uint32_t i;
+
+    if (zstr(amd.bandit_state_file)) {
+        return;
+    }
+
+    switch_snprintf(tmp, sizeof(tmp), "%s.tmp", amd.bandit_state_file);
+    if (!(fp = fopen(tmp, "w"))) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    switch_thread_rwlock_rdlock(amd.config_lock);
+    fprintf(fp, "# mod_amd bandit state v1: name pulls trials reward\n");
+    for (i = 0; i < amd.arm_count; i++) {
+        fprintf(fp, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", amd.arms[i].name,
+                (uint64_t)atomic_load(&amd.arms[i].pulls),
+                (uint64_t)atomic_load(&amd.arms[i].trials),
+                (uint64_t)atomic_load(&amd.arms[i].reward));
+    }
+    switch_thread_rwlock_unlock(amd.config_lock);
+
+    if (fclose(fp) || rename(tmp, amd.bandit_state_file)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot save %s: %s\n",
+                          amd.bandit_state_file, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+static void amd_bandit_restore(void)
+{
+    char line[256], name[AMD_PROFILE_NAME_LEN];
+    uint64_t pulls, trials, reward;
+    FILE *fp;
+
+    if (zstr(amd.bandit_state_file) || !(fp = fopen(amd.bandit_state_file, "r"))) {
+        return;
+    }
+
+    switch_thread_rwlock_wrlock(amd.config_lock);
+    while (fgets(line, sizeof(line), fp)) {
+        int arm;
+
+        if (*line == '#' || sscanf(line, "%63s %" SCNu64 " %" SCNu64 " %" SCNu64, name, &pulls, &trials, &reward) != 4) {
+            continue;
+        }
+
+        if ((arm = amd_arm_lookup(name, SWITCH_TRUE)) >= 0) {
+            atomic_store(&amd.arms[arm].pulls, pulls);
+            atomic_store(&amd.arms[arm].trials, trials);
+            atomic_store(&amd.arms[arm].reward, reward);
+        }
+    }
+    switch_thread_rwlock_unlock(amd.config_lock);
+
+    fclose(fp);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AMD: Restored bandit state from %s\n", amd.bandit_state_file);
+}
+
+/* -------------------------
+   Destination result cache
+   ------------------------- */
+
+static uint64_t amd_cache_hash(const char *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h ? h : 1;
+}
+
+/* Map (or create) the host-wide segment shared by every mod_amd instance */
+static switch_status_t amd_cache_shm_init(void)
+{
+    amd_shm_cache_t *shm;
+    uint32_t slots = amd.cache_entries < AMD_CACHE_PROBE ? AMD_CACHE_PROBE : amd.cache_entries;
+    switch_size_t size = sizeof(amd_shm_cache_t) + (switch_size_t)slots * sizeof(amd_shm_slot_t);
+    struct stat st;
+    int fd, waited;
+
+    if ((fd = shm_open(amd.cache_shm_name, O_RDWR | O_CREAT | O_EXCL, 0660)) >= 0) {
+        if (ftruncate(fd, (off_t)size)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot size %s: %s\n", amd.cache_shm_name, strerror(errno));
+            close(fd);
+            shm_unlink(amd.cache_shm_name);
+            return SWITCH_STATUS_FALSE;
+        }
+        amd.cache_shm_created = SWITCH_TRUE;
+    } else if (errno != EEXIST || (fd = shm_open(amd.cache_shm_name, O_RDWR, 0)) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot open %s: %s\n", amd.cache_shm_name, strerror(errno));
+        return SWITCH_STATUS_FALSE;
+    } else {
+        /* The creator may not have sized the segment yet */
+        for (waited = 0; !fstat(fd, &st) && (switch_size_t)st.st_size < sizeof(amd_shm_cache_t) && waited < 100; waited++) {
+            switch_yield(10000);
+        }
+
+        if (fstat(fd, &st) || (switch_size_t)st.st_size < sizeof(amd_shm_cache_t)) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: %s was never sized by its creator\n", amd.cache_shm_name);
+            close(fd);
+            return SWITCH_STATUS_FALSE;
+        }
+        size = (switch_size_t)st.st_size;
+    }
+
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED || size < sizeof(amd_shm_cache_t)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot map %s\n", amd.cache_shm_name);
+        if (shm != MAP_FAILED) munmap(shm, size);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if (amd.cache_shm_created) {
+        shm->version = 1;
+        shm->slot_size = sizeof(amd_shm_slot_t);
+        shm->slots = slots;
+        atomic_store_explicit(&shm->ready, AMD_CACHE_MAGIC, memory_order_release);
+    } else {
+        /* Another instance may still be initialising the segment */
+        for (waited = 0; atomic_load_explicit(&shm->ready, memory_order_acquire) != AMD_CACHE_MAGIC && waited < 100; waited++) {
+            switch_yield(10000);
+        }
+
+        if (atomic_load_explicit(&shm->ready, memory_order_acquire) != AMD_CACHE_MAGIC || shm->version != 1 ||
+            shm->slot_size != sizeof(amd_shm_slot_t) ||
+            sizeof(amd_shm_cache_t) + (switch_size_t)shm->slots * sizeof(amd_shm_slot_t) > size) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,
+                              "AMD: %s has an incompatible layout; remove it or change cache_shm_name\n", amd.cache_shm_name);
+            munmap(shm, size);
+            return SWITCH_STATUS_FALSE;
+        }
+
+        if (shm->slots != slots) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE,
+                              "AMD: Using existing %s with %u entries (cache_entries=%u ignored)\n",
+                              amd.cache_shm_name, shm->slots, amd.cache_entries);
+        }
+    }
+
+    amd.cache_shm = shm;
+    amd.cache_shm_size = size;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AMD: Result cache in shared memory %s, %u entries (%" SWITCH_SIZE_T_FMT " bytes)%s\n",
+                      amd.cache_shm_name, shm->slots, size, amd.cache_shm_created ? ", created" : "");
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t amd_cache_init(void)
+{
+    uint32_t i;
+
+    if (!amd.cache_entries) {
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!zstr(amd.cache_shm_name)) {
+        if (amd_cache_shm_init() == SWITCH_STATUS_SUCCESS) {
+            return SWITCH_STATUS_SUCCESS;
+        }
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Falling back to a private result cache\n");
+    }
+
+    if (!amd.cache_shard_count) {
+        amd.cache_shard_count = 1;
+    }
+
+    amd.cache_shard_slots = amd.cache_entries / amd.cache_shard_count;
+    if (amd.cache_shard_slots < AMD_CACHE_PROBE) {
+        amd.cache_shard_slots = AMD_CACHE_PROBE;
+    }
+
+    amd.cache_shards = switch_core_alloc(amd.pool, sizeof(amd_cache_shard_t) * amd.cache_shard_count);
+    for (i = 0; i < amd.cache_shard_count; i++) {
+        switch_mutex_init(&amd.cache_shards[i].mutex, SWITCH_MUTEX_NESTED, amd.pool);
+        amd.cache_shards[i].slots = switch_core_alloc(amd.pool, sizeof(amd_cache_entry_t) * amd.cache_shard_slots);
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AMD: Result cache %u x %u entries (%" SWITCH_SIZE_T_FMT " bytes)\n",
+                      amd.cache_shard_count, amd.cache_shard_slots,
+                      (switch_size_t)amd.cache_shard_count * amd.cache_shard_slots * sizeof(amd_cache_entry_t));
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static void amd_cache_shutdown(void)
+{
+    if (amd.cache_shm) {
+        munmap(amd.cache_shm, amd.cache_shm_size);
+        amd.cache_shm = NULL;
+    }
+}
+
+static switch_bool_t amd_cache_enabled(void)
+{
+    return amd.cache_shards || amd.cache_shm;
+}
+
+static amd_cache_shard_t *amd_cache_shard(uint64_t hash, uint32_t *first)
+{
+    *first = (uint32_t)((hash >> 32) % amd.cache_shard_slots);
+    return &amd.cache_shards[hash % amd.cache_shard_count];
+}
+
+static switch_bool_t amd_cache_expired(const amd_cache_entry_t *e, uint32_t now)
+{
+    return amd.cache_ttl && now - e->stored > amd.cache_ttl;
+}
+
+static switch_bool_t amd_cache_match(const amd_cache_entry_t *e, uint64_t hash, const char *key)
+{
+    return e->hash == hash && !strncmp(e->key, key, sizeof(e->key) - 1);
+}
+
+/* Choose where an entry goes within a probe window: same key, else an empty or
+ * expired slot, else the least recently used one. Sets *evict when a live entry is displaced. */
+static uint32_t amd_cache_pick(amd_cache_entry_t *const win[AMD_CACHE_PROBE], const amd_cache_entry_t *entry,
+                               uint32_t now, switch_bool_t *evict)
+{
+    uint32_t i, victim = 0;
+    switch_bool_t victim_free = SWITCH_FALSE;
+
+    for (i = 0; i < AMD_CACHE_PROBE; i++) {
+        if (amd_cache_match(win[i], entry->hash, entry->key)) {
+            *evict = SWITCH_FALSE;
+            return i;
+        }
+        if (!win[i]->hash || amd_cache_expired(win[i], now)) {
+            if (!victim_free) {
+                victim = i;
+                victim_free = SWITCH_TRUE;
+            }
+        } else if (!victim_free && win[i]->used < win[victim]->used) {
+            victim = i;
+        }
+    }
+
+    *evict = !victim_free;
+    return victim;
+}
+
+/* Fill *out with the new contents of a slot: the entry, carrying the decision count forward */
+static void amd_cache_merge(amd_cache_entry_t *out, const amd_cache_entry_t *old, const amd_cache_entry_t *entry, switch_bool_t bump)
+{
+    uint32_t count = amd_cache_match(old, entry->hash, entry->key) ? old->count + 1 : 1;
+
+    *out = *entry;
+    if (bump) {
+        out->count = count;
+    }
+}
+
+/* Seqlock read of one shared slot; fails if a writer keeps it busy */
+static switch_bool_t amd_shm_slot_read(amd_shm_slot_t *slot, amd_cache_entry_t *out, uint32_t *seq)
+{
+    int tries;
+
+    for (tries = 0; tries < 64; tries++) {
+        uint32_t s1 = (uint32_t)atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (s1 & 1) {
+            continue;
+        }
+
+        memcpy(out, &slot->entry, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+
+        if ((uint32_t)atomic_load_explicit(&slot->seq, memory_order_relaxed) == s1) {
+            *seq = s1;
+            return SWITCH_TRUE;
+        }
+    }
+
+    return SWITCH_FALSE;
+}
+
+/* Seqlock write; succeeds only if the slot is unchanged since it was read at seq */
+static switch_bool_t amd_shm_slot_write(amd_shm_slot_t *slot, uint32_t seq, const amd_cache_entry_t *in)
+{
+    uint_fast32_t expected = seq;
+
+    if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&slot->seq, &expected, seq + 1, memory_order_acquire, memory_order_relaxed)) {
+        return SWITCH_FALSE;
+    }
+
+    memcpy(&slot->entry, in, sizeof(*in));
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+    return SWITCH_TRUE;
+}
+
+static switch_bool_t amd_cache_shm_lookup(uint64_t hash, const char *key, amd_cache_entry_t *out, uint32_t now)
+{
+    amd_shm_cache_t *shm = amd.cache_shm;
+    uint32_t i, seq, first = (uint32_t)(hash % shm->slots);
+
+    for (i = 0; i < AMD_CACHE_PROBE; i++) {
+        amd_shm_slot_t *slot = &shm->slot[(first + i) % shm->slots];
+
+        if (amd_shm_slot_read(slot, out, &seq) && amd_cache_match(out, hash, key) && !amd_cache_expired(out, now)) {
+            amd_cache_entry_t touched = *out;
+
+            /* LRU touch is best effort; a concurrent writer wins */
+            touched.used = now;
+            amd_shm_slot_write(slot, seq, &touched);
+            return SWITCH_TRUE;
+        }
+    }
+
+    return SWITCH_FALSE;
+}
+
+static void amd_cache_shm_put(const amd_cache_entry_t *entry, switch_bool_t bump, uint32_t now)
+{
+    amd_shm_cache_t *shm = amd.cache_shm;
+    uint32_t i, tries, first = (uint32_t)(entry->hash % shm->slots);
+    amd_cache_entry_t copy[AMD_CACHE_PROBE], *win[AMD_CACHE_PROBE], merged;
+    uint32_t seq[AMD_CACHE_PROBE];
+    switch_bool_t evict;
+
+    for (i = 0; i < AMD_CACHE_PROBE; i++) {
+        win[i] = &copy[i];
+    }
+
+    /* Lock-free: re-read the window and retry if another writer got there first */
+    for (tries = 0; tries < 4; tries++) {
+        uint32_t v;
+
+        for (i = 0; i < AMD_CACHE_PROBE; i++) {
+            if (!amd_shm_slot_read(&shm->slot[(first + i) % shm->slots], &copy[i], &seq[i])) {
+                memset(&copy[i], 0xff, sizeof(copy[i]));    /* busy: never picked as free or LRU */
+                copy[i].used = UINT32_MAX;
+                copy[i].stored = now;
+                seq[i] = 1;
+            }
+        }
+
+        v = amd_cache_pick(win, entry, now, &evict);
+        amd_cache_merge(&merged, &copy[v], entry, bump);
+
+        if (amd_shm_slot_write(&shm->slot[(first + v) % shm->slots], seq[v], &merged)) {
+            atomic_fetch_add_explicit(&shm->stores, 1, memory_order_relaxed);
+            if (evict) {
+                atomic_fetch_add_explicit(&shm->evictions, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&amd.cache_evictions, 1, memory_order_relaxed);
+            }
+            return;
+        }
+    }
+}
+
+/* Copy the history for a destination into *out */
+static switch_bool_t amd_cache_lookup(const char *key, amd_cache_entry_t *out)
+{
+    uint64_t hash;
+    uint32_t first, i, now = (uint32_t)switch_epoch_time_now(NULL);
+    amd_cache_shard_t *shard;
+    switch_bool_t found = SWITCH_FALSE;
+
+    if (!amd_cache_enabled() || zstr(key)) {
+        return SWITCH_FALSE;
+    }
+
+    hash = amd_cache_hash(key);
+
+    if (amd.cache_shm) {
+        found = amd_cache_shm_lookup(hash, key, out, now);
+    } else {
+        shard = amd_cache_shard(hash, &first);
+
+        switch_mutex_lock(shard->mutex);
+        for (i = 0; i < AMD_CACHE_PROBE; i++) {
+            amd_cache_entry_t *e = &shard->slots[(first + i) % amd.cache_shard_slots];
+
+            if (amd_cache_match(e, hash, key) && !amd_cache_expired(e, now)) {
+                e->used = now;
+                *out = *e;
+                found = SWITCH_TRUE;
+                break;
+            }
+        }
+        switch_mutex_unlock(shard->mutex);
+    }
+
+    atomic_fetch_add_explicit(found ? &amd.cache_hits : &amd.cache_misses, 1, memory_order_relaxed);
+    return found;
+}
+
+static void amd_cache_put(const amd_cache_entry_t *entry, switch_bool_t bump)
+{
+    uint32_t first, i, v, now = (uint32_t)switch_epoch_time_now(NULL);
+    amd_cache_shard_t *shard;
+    amd_cache_entry_t *win[AMD_CACHE_PROBE], merged;
+    switch_bool_t evict;
+
+    if (amd.cache_shm) {
+        amd_cache_shm_put(entry, bump, now);
+        return;
+    }
+
+    shard = amd_cache_shard(entry->hash, &first);
+
+    switch_mutex_lock(shard->mutex);
+    for (i = 0; i < AMD_CACHE_PROBE; i++) {
+        win[i] = &shard->slots[(first + i) % amd.cache_shard_slots];
+    }
+
+    v = amd_cache_pick(win, entry, now, &evict);
+    amd_cache_merge(&merged, win[v], entry, bump);
+    *win[v] = merged;
+    switch_mutex_unlock(shard->mutex);
+
+    if (evict) {
+        atomic_fetch_add_explicit(&amd.cache_evictions, 1, memory_order_relaxed);
+    }
+}
+
+static void amd_cache_store(const char *key, const char *result, const char *cause)
+{
+    amd_cache_entry_t entry = { 0 };
+
+    if (!amd_cache_enabled() || zstr(key)) {
+        return;
+    }
+
+    entry.hash = amd_cache_hash(key);
+    switch_copy_string(entry.key, key, sizeof(entry.key));
+    switch_copy_string(entry.result, result, sizeof(entry.result));
+    switch_copy_string(entry.cause, cause, sizeof(entry.cause));
+    entry.stored = entry.used = (uint32_t)switch_epoch_time_now(NULL);
+
+    amd_cache_put(&entry, SWITCH_TRUE);
+    atomic_fetch_add_explicit(&amd.cache_stores, 1, memory_order_relaxed);
+}
+
+static void amd_cache_save_entry(FILE *fp, const amd_cache_entry_t *e, uint32_t now, uint32_t *count)
+{
+    if (e->hash && !amd_cache_expired(e, now)) {
+        fwrite(e, sizeof(*e), 1, fp);
+        (*count)++;
+    }
+}
+
+/* Snapshot format: magic, entry size, count, then live entries. Bounded by the table size. */
+static void amd_cache_save(void)
+{
+    char tmp[1024];
+    uint32_t header[3] = { AMD_CACHE_MAGIC, sizeof(amd_cache_entry_t), 0 };
+    uint32_t i, j, seq, now = (uint32_t)switch_epoch_time_now(NULL);
+    amd_cache_entry_t *copy;
+    FILE *fp;
+
+    if (!amd_cache_enabled() || zstr(amd.cache_snapshot_file)) {
+        return;
+    }
+
+    switch_snprintf(tmp, sizeof(tmp), "%s.tmp", amd.cache_snapshot_file);
+    if (!(fp = fopen(tmp, "wb"))) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    fwrite(header, sizeof(header), 1, fp);
+
+    if (amd.cache_shm) {
+        amd_cache_entry_t e;
+
+        for (i = 0; i < amd.cache_shm->slots; i++) {
+            if (amd_shm_slot_read(&amd.cache_shm->slot[i], &e, &seq)) {
+                amd_cache_save_entry(fp, &e, now, &header[2]);
+            }
+        }
+    } else {
+        copy = malloc(sizeof(amd_cache_entry_t) * amd.cache_shard_slots);
+        switch_assert(copy);
+
+        for (i = 0; i < amd.cache_shard_count; i++) {
+            switch_mutex_lock(amd.cache_shards[i].mutex);
+            memcpy(copy, amd.cache_shards[i].slots, sizeof(amd_cache_entry_t) * amd.cache_shard_slots);
+            switch_mutex_unlock(amd.cache_shards[i].mutex);
+
+            for (j = 0; j < amd.cache_shard_slots; j++) {
+                amd_cache_save_entry(fp, &copy[j], now, &header[2]);
+            }
+        }
+        free(copy);
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(header, sizeof(header), 1, fp);
+
+    if (fclose(fp) || rename(tmp, amd.cache_snapshot_file)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot save %s: %s\n",
+                          amd.cache_snapshot_file, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+static void amd_cache_restore(void)
+{
+    uint32_t header[3], i, loaded = 0, now = (uint32_t)switch_epoch_time_now(NULL);
+    amd_cache_entry_t entry;
+    FILE *fp;
+
+    /* A shared segment that already existed is warm; only its creator restores */
+    if (!amd_cache_enabled() || (amd.cache_shm && !amd.cache_shm_created) ||
+        zstr(amd.cache_snapshot_file) || !(fp = fopen(amd.cache_snapshot_file, "rb"))) {
+        return;
+    }
+
+    if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != AMD_CACHE_MAGIC || header[1] != sizeof(entry)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Ignoring incompatible cache snapshot %s\n",
+                          amd.cache_snapshot_file);
+        fclose(fp);
+        return;
+    }
+
+    for (i = 0; i < header[2] && fread(&entry, sizeof(entry), 1, fp) == 1; i++) {
+        entry.key[sizeof(entry.key) - 1] = '\0';
+        entry.result[sizeof(entry.result) - 1] = '\0';
+        entry.cause[sizeof(entry.cause) - 1] = '\0';
+        if (entry.hash && !amd_cache_expired(&entry, now)) {
+            amd_cache_put(&entry, SWITCH_FALSE);
+            loaded++;
+        }
+    }
+
+    fclose(fp);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AMD: Restored %u cached result(s) from %s\n",
+                      loaded, amd.cache_snapshot_file);
+}
+
+/* -------------------------
+   Bounded lock-free MPSC queue
+   ------------------------- */
+
+static void amd_ring_init(amd_ring_t *ring, switch_memory_pool_t *pool, uint32_t slots, size_t payload)
+{
+    size_t n = 2, i;
+
+    while (n < slots) {
+        n <<= 1;
+    }
+
+    ring->cell_size = (sizeof(amd_ring_cell_t) + payload + 15) & ~(size_t)15;
+    ring->mask = n - 1;
+    ring->cells = switch_core_alloc(pool, ring->cell_size * n);
+    ring->tail = 0;
+    atomic_init(&ring->head, 0);
+
+    for (i = 0; i < n; i++) {
+        atomic_init(&((amd_ring_cell_t *)(ring->cells + i * ring->cell_size))->seq, i);
+    }
+}
+
+static amd_ring_cell_t *amd_ring_cell(amd_ring_t *ring, size_t pos)
+{
+    return (amd_ring_cell_t *)(ring->cells + (pos & ring->mask) * ring->cell_size);
+}
+
+/* Producer: claim a cell to fill, or NULL when the queue is full. Never blocks. */
+static void *amd_ring_claim(amd_ring_t *ring)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    for (;;) {
+        amd_ring_cell_t *cell = amd_ring_cell(ring, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        if (!dif) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                return cell + 1;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+/* Producer: hand a filled cell to the consumer */
+static void amd_ring_publish(void *payload)
+{
+    amd_ring_cell_t *cell = (amd_ring_cell_t *)payload - 1;
+
+    atomic_store_explicit(&cell->seq, atomic_load_explicit(&cell->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* Consumer: next published cell, or NULL */
+static void *amd_ring_peek(amd_ring_t *ring)
+{
+    amd_ring_cell_t *cell = amd_ring_cell(ring, ring->tail);
+
+    if (atomic_load_explicit(&cell->seq, memory_order_acquire) != ring->tail + 1) {
+        return NULL;
+    }
+
+    return cell + 1;
+}
+
+/* Consumer: give the cell returned by amd_ring_peek back to producers */
+static void amd_ring_release(amd_ring_t *ring)
+{
+    amd_ring_cell_t *cell = amd_ring_cell(ring, ring->tail);
+
+    atomic_store_explicit(&cell->seq, ring->tail + ring->mask + 1, memory_order_release);
+    ring->tail++;
+}
+
+/* -------------------------
+   External classifier
+   -------------------------
+ * Frames are queued by the media bug and written by one thread over a single
+ * UNIX or TCP stream. Every message is a 12-byte header (network order):
+ *   uint32 payload length, uint16 type, uint16 reserved, uint32 call id
+ * followed by the payload:
+ *   START   uint32 sample rate, then the channel UUID
+ *   AUDIO   signed 16-bit mono PCM in host byte order
+ *   STOP    empty
+ *   VERDICT (classifier to module) ASCII "<HUMAN|MACHINE|NOTSURE> <CAUSE>"
+ */
+
+static int amd_ext_connect(const char *endpoint)
+{
+    int fd = -1, one = 1;
+
+    if (!strncasecmp(endpoint, "unix:", 5)) {
+        struct sockaddr_un sun = { 0 };
+
+        sun.sun_family = AF_UNIX;
+        switch_copy_string(sun.sun_path, endpoint + 5, sizeof(sun.sun_path));
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (!strncasecmp(endpoint, "tcp:", 4)) {
+        char host[256], *port;
+        struct addrinfo hints = { 0 }, *res = NULL, *ai;
+
+        switch_copy_string(host, endpoint + 4, sizeof(host));
+        if (!(port = strrchr(host, ':'))) {
+            return -1;
+        }
+        *port++ = '\0';
+
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &res)) {
+            return -1;
+        }
+
+        for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+
+        if (fd >= 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    return fd;
+}
+
+static size_t amd_ext_encode(const amd_ext_msg_t *msg, uint8_t *out)
+{
+    uint32_t len = 0, v;
+    uint16_t t = htons(msg->type), zero = 0;
+
+    switch (msg->type) {
+    case AMD_EXT_START:
+        v = htonl(msg->rate);
+        len = (uint32_t)strlen(msg->uuid);
+        memcpy(out + 12, &v, 4);
+        memcpy(out + 16, msg->uuid, len);
+        len += 4;
+        break;
+    case AMD_EXT_AUDIO:
+        len = msg->samples * sizeof(int16_t);
+        memcpy(out + 12, msg->data, len);
+        break;
+    default:
+        break;
+    }
+
+    v = htonl(len);
+    memcpy(out, &v, 4);
+    memcpy(out + 4, &t, 2);
+    memcpy(out + 6, &zero, 2);
+    v = htonl(msg->call_id);
+    memcpy(out + 8, &v, 4);
+
+    return 12 + len;
+}
+
+/* Remote causes end up in channel variables, events, JSON and file names: A-Z, 0-9, '_' and '-' only */
+static switch_bool_t amd_cause_valid(const char *cause)
+{
+    for (; *cause; cause++) {
+        if (!((*cause >= 'A' && *cause <= 'Z') || (*cause >= '0' && *cause <= '9') || *cause == '_' || *cause == '-')) {
+            return SWITCH_FALSE;
+        }
+    }
+
+    return SWITCH_TRUE;
+}
+
+/*
+ * Post a verdict into the caller's mailbox if the call is still streaming.
+ * The slot can be reused for call_id + AMD_EXT_SLOTS while we write it, so
+ * the verdict is tagged with call_id and the owner only takes its own tag.
+ * Only the classifier thread delivers, so writes to one slot never overlap.
+ */
+static void amd_ext_deliver(uint32_t call_id, const char *text, size_t len)
+{
+    amd_ext_slot_t *slot = &amd.classifier_slots[call_id % AMD_EXT_SLOTS];
+    char buf[64], *cause;
+
+    if (atomic_load_explicit(&slot->call_id, memory_order_acquire) != call_id ||
+        atomic_load_explicit(&slot->verdict, memory_order_relaxed) == call_id) {
+        return;
+    }
+
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+
+    if ((cause = strchr(buf, ' '))) {
+        *cause++ = '\0';
+    }
+
+    if (strcmp(buf, "HUMAN") && strcmp(buf, "MACHINE") && strcmp(buf, "NOTSURE")) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Classifier sent bad verdict [%s]\n", buf);
+        return;
+    }
+
+    if (cause && !amd_cause_valid(cause)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Classifier sent bad cause; using REMOTE\n");
+        cause = NULL;
+    }
+
+    switch_copy_string(slot->result, buf, sizeof(slot->result));
+    switch_copy_string(slot->cause, zstr(cause) ? "REMOTE" : cause, sizeof(slot->cause));
+    atomic_store_explicit(&slot->verdict, call_id, memory_order_release);
+
+    if (atomic_load_explicit(&slot->call_id, memory_order_acquire) == call_id) {
+        atomic_fetch_add_explicit(&amd.classifier_verdicts, 1, memory_order_relaxed);
+    }
+}
+
+/* Consume complete messages from the receive buffer; returns bytes used */
+static size_t amd_ext_parse(const uint8_t *in, size_t len)
+{
+    size_t used = 0;
+
+    while (len - used >= 12) {
+        uint32_t plen, call_id;
+        uint16_t type;
+
+        memcpy(&plen, in + used, 4);
+        memcpy(&type, in + used + 4, 2);
+        memcpy(&call_id, in + used + 8, 4);
+        plen = ntohl(plen);
+
+        if (len - used < 12 + (size_t)plen) {
+            break;
+        }
+
+        if (ntohs(type) == AMD_EXT_VERDICT) {
+            amd_ext_deliver(ntohl(call_id), (const char *)in + used + 12, plen);
+        }
+        used += 12 + plen;
+    }
+
+    return used;
+}
+
+static void *SWITCH_THREAD_FUNC amd_ext_run(switch_thread_t *thread, void *obj)
+{
+    uint8_t *out = malloc(AMD_EXT_BATCH), in[4096];
+    size_t outlen = 0, outoff = 0, inlen = 0;
+    switch_time_t next_connect = 0;
+    int fd = -1;
+
+    (void)thread;
+    (void)obj;
+    switch_assert(out);
+
+    while (atomic_load(&amd.running)) {
+        struct pollfd pfd = { 0 };
+        amd_ext_msg_t *msg;
+        switch_bool_t idle = SWITCH_TRUE;
+
+        if (fd < 0 && switch_micro_time_now() >= next_connect) {
+            if ((fd = amd_ext_connect(amd.classifier_endpoint)) < 0) {
+                next_connect = switch_micro_time_now() + 1000000;
+            } else {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AMD: Connected to classifier %s\n", amd.classifier_endpoint);
+                outlen = outoff = inlen = 0;
+                atomic_store(&amd.classifier_connected, 1);
+            }
+        }
+
+        /* Batch everything queued since the last pass into one write */
+        while (outlen + 12 + sizeof(msg->data) + sizeof(msg->uuid) <= AMD_EXT_BATCH && (msg = amd_ring_peek(&amd.classifier_ring))) {
+            if (fd >= 0) {
+                outlen += amd_ext_encode(msg, out + outlen);
+                atomic_fetch_add_explicit(&amd.classifier_sent, 1, memory_order_relaxed);
+            } else {
+                atomic_fetch_add_explicit(&amd.classifier_dropped, 1, memory_order_relaxed);
+            }
+            amd_ring_release(&amd.classifier_ring);
+            idle = SWITCH_FALSE;
+        }
+
+        if (fd < 0) {
+            switch_yield(idle ? 10000 : 1000);
+            continue;
+        }
+
+        if (outoff < outlen) {
+            ssize_t n = send(fd, out + outoff, outlen - outoff, MSG_NOSIGNAL);
+
+            if (n > 0) {
+                outoff += (size_t)n;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                goto disconnect;
+            }
+        }
+
+        if (outoff == outlen) {
+            outoff = outlen = 0;
+        } else if (outoff) {
+            memmove(out, out + outoff, outlen - outoff);
+            outlen -= outoff;
+            outoff = 0;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN | (outlen ? POLLOUT : 0);
+        if (poll(&pfd, 1, idle ? 5 : 0) > 0) {
+            if (pfd.revents & (POLLERR | POLLHUP)) {
+                goto disconnect;
+            }
+            if (pfd.revents & POLLIN) {
+                ssize_t n = recv(fd, in + inlen, sizeof(in) - inlen, 0);
+                size_t used;
+
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    goto disconnect;
+                }
+                if (n > 0) {
+                    inlen += (size_t)n;
+                    used = amd_ext_parse(in, inlen);
+                    if (!used && inlen == sizeof(in)) {
+                        goto disconnect;    /* oversized message */
+                    }
+                    memmove(in, in + used, inlen - used);
+                    inlen -= used;
+                }
+            }
+        }
+        continue;
+
+    disconnect:
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Lost classifier %s\n", amd.classifier_endpoint);
+        close(fd);
+        fd = -1;
+        atomic_store(&amd.classifier_connected, 0);
+        next_connect = switch_micro_time_now() + 1000000;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(out);
+    return NULL;
+}
+
+static void amd_ext_init(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    if (zstr(amd.classifier_endpoint)) {
+        return;
+    }
+
+    amd_ring_init(&amd.classifier_ring, amd.pool, amd.classifier_queue ? amd.classifier_queue : 2048, sizeof(amd_ext_msg_t));
+    amd.classifier_slots = switch_core_alloc(amd.pool, sizeof(amd_ext_slot_t) * AMD_EXT_SLOTS);
+
+    switch_threadattr_create(&thd_attr, amd.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&amd.classifier_thread, thd_attr, amd_ext_run, NULL, amd.pool);
+}
+
+/* Reserve a verdict mailbox; returns the call id or 0 when none is free */
+static uint32_t amd_ext_open(void)
+{
+    uint32_t tries;
+
+    if (!amd.classifier_slots || !atomic_load(&amd.classifier_connected)) {
+        return 0;
+    }
+
+    for (tries = 0; tries < AMD_EXT_SLOTS; tries++) {
+        uint32_t id = (uint32_t)atomic_fetch_add(&amd.classifier_next_id, 1) + 1;
+        amd_ext_slot_t *slot = &amd.classifier_slots[id % AMD_EXT_SLOTS];
+        uint_fast32_t expected = 0;
+
+        if (id && atomic_compare_exchange_strong(&slot->call_id, &expected, id)) {
+            atomic_store(&slot->verdict, 0);
+            return id;
+        }
+    }
+
+    return 0;
+}
+
+static void amd_ext_close(uint32_t call_id)
+{
+    atomic_store_explicit(&amd.classifier_slots[call_id % AMD_EXT_SLOTS].call_id, 0, memory_order_release);
+}
+
+/* Queue one message; frames that do not fit are dropped rather than waited for */
+static void amd_ext_send(uint32_t call_id, uint16_t type, const int16_t *data, uint32_t samples, uint32_t rate, const char *uuid)
+{
+    do {
+        uint32_t n = samples > AMD_EXT_MAX_SAMPLES ? AMD_EXT_MAX_SAMPLES : samples;
+        amd_ext_msg_t *msg = amd_ring_claim(&amd.classifier_ring);
+
+        if (!msg) {
+            atomic_fetch_add_explicit(&amd.classifier_dropped, 1, memory_order_relaxed);
+            return;
+        }
+
+        msg->call_id = call_id;
+        msg->type = type;
+        msg->samples = (uint16_t)n;
+        msg->rate = rate;
+        if (uuid) {
+            switch_copy_string(msg->uuid, uuid, sizeof(msg->uuid));
+        }
+        if (n) {
+            memcpy(msg->data, data, n * sizeof(int16_t));
+        }
+        amd_ring_publish(msg);
+
+        data += n;
+        samples -= n;
+    } while (samples);
+}
+
+/* -------------------------
+   Shared-memory audio arena
+   ------------------------- */
+
+static void amd_shm_doorbell(void)
+{
+    static const uint64_t one = 1;
+
+    /*
+     * Order our head / generation store before the sleeping load. The
+     * analyser fences between setting sleeping and re-checking head, so at
+     * least one side sees the other and the wakeup cannot be lost.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* Only a sleeping analyser costs a syscall */
+    if (atomic_load_explicit(&amd.audio_shm->sleeping, memory_order_acquire) &&
+        atomic_exchange_explicit(&amd.audio_shm->sleeping, 0, memory_order_acq_rel)) {
+        if (write(amd.audio_shm_efd, &one, sizeof(one)) < 0) {
+            /* counter saturated; the analyser is awake anyway */
+        }
+    }
+}
+
+/* Pass the doorbell eventfd to one analyser with SCM_RIGHTS */
+static void amd_shm_send_fd(int fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char tag = 'E';
+
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &amd.audio_shm_efd, sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AMD: Cannot pass eventfd: %s\n", strerror(errno));
+    }
+}
+
+static void *SWITCH_THREAD_FUNC amd_shm_listen_run(switch_thread_t *thread, void *obj)
+{
+    (void)thread;
+    (void)obj;
+
+    while (atomic_load(&amd.running)) {
+        struct pollfd pfd = { amd.audio_shm_listen, POLLIN, 0 };
+        int fd;
+
+        if (poll(&pfd, 1, 500) > 0 && (fd = accept(amd.audio_shm_listen, NULL, NULL)) >= 0) {
+            amd_shm_send_fd(fd);
+            close(fd);
+        }
+    }
+
+    close(amd.audio_shm_listen);
+    unlink(amd.audio_shm_socket);
+    amd.audio_shm_listen = -1;
+    return NULL;
+}
+
+/* Serve the eventfd on audio_shm_socket, for analysers that cannot use pidfd_getfd() */
+static void amd_shm_listen(void)
+{
+    struct sockaddr_un sun = { 0 };
+    switch_threadattr_t *thd_attr = NULL;
+    int fd;
+
+    if (zstr(amd.audio_shm_socket)) {
+        return;
+    }
+
+    if (strlen(amd.audio_shm_socket) >= sizeof(sun.sun_path)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: audio_shm_socket path too long\n");
+        return;
+    }
+
+    sun.sun_family = AF_UNIX;
+    switch_copy_string(sun.sun_path, amd.audio_shm_socket, sizeof(sun.sun_path));
+    unlink(amd.audio_shm_socket);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || chmod(amd.audio_shm_socket, 0660) || listen(fd, 16)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot listen on %s: %s\n", amd.audio_shm_socket, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    amd.audio_shm_listen = fd;
+    switch_threadattr_create(&thd_attr, amd.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&amd.audio_shm_thread, thd_attr, amd_shm_listen_run, NULL, amd.pool);
+}
+
+static void amd_audio_shm_init(void)
+{
+    amd_shm_arena_t *arena;
+    uint32_t sessions = amd.audio_shm_sessions ? amd.audio_shm_sessions : 256;
+    switch_size_t size = sizeof(amd_shm_arena_t) + (switch_size_t)sessions * sizeof(amd_shm_session_t);
+    int fd;
+
+    amd.audio_shm_efd = -1;
+    amd.audio_shm_listen = -1;
+
+    if (zstr(amd.audio_shm_name)) {
+        return;
+    }
+
+    /* The arena belongs to this process; a leftover one is from a previous run */
+    shm_unlink(amd.audio_shm_name);
+
+    if ((fd = shm_open(amd.audio_shm_name, O_RDWR | O_CREAT | O_EXCL, 0660)) < 0 || ftruncate(fd, (off_t)size)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot create %s: %s\n", amd.audio_shm_name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(amd.audio_shm_name);
+        }
+        return;
+    }
+
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (arena == MAP_FAILED) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot map %s: %s\n", amd.audio_shm_name, strerror(errno));
+        shm_unlink(amd.audio_shm_name);
+        return;
+    }
+
+    if ((amd.audio_shm_efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot create eventfd: %s\n", strerror(errno));
+        munmap(arena, size);
+        shm_unlink(amd.audio_shm_name);
+        return;
+    }
+
+    arena->version = 1;
+    arena->sessions = sessions;
+    arena->ring_frames = AMD_SHM_RING_FRAMES;
+    arena->frame_samples = AMD_EXT_MAX_SAMPLES;
+    arena->session_size = sizeof(amd_shm_session_t);
+    arena->pid = (int32_t)getpid();
+    arena->eventfd = amd.audio_shm_efd;
+    atomic_store_explicit(&arena->magic, AMD_SHM_MAGIC, memory_order_release);
+
+    amd.audio_shm = arena;
+    amd.audio_shm_size = size;
+    amd.audio_shm_owned = switch_core_alloc(amd.pool, sizeof(atomic_int) * sessions);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AMD: Audio arena %s, %u sessions (%" SWITCH_SIZE_T_FMT " bytes), eventfd %d\n",
+                      amd.audio_shm_name, sessions, size, amd.audio_shm_efd);
+
+    amd_shm_listen();
+}
+
+static void amd_audio_shm_shutdown(void)
+{
+    switch_status_t st;
+
+    if (amd.audio_shm_thread) {
+        switch_thread_join(&st, amd.audio_shm_thread);
+        amd.audio_shm_thread = NULL;
+    }
+    if (amd.audio_shm) {
+        atomic_store(&amd.audio_shm->magic, 0);
+        munmap(amd.audio_shm, amd.audio_shm_size);
+        shm_unlink(amd.audio_shm_name);
+        amd.audio_shm = NULL;
+    }
+    if (amd.audio_shm_efd >= 0) {
+        close(amd.audio_shm_efd);
+        amd.audio_shm_efd = -1;
+    }
+}
+
+/*
+ * Claim a free session for a call; *generation receives its (odd) generation.
+ * The claim is process-local, so the session is reset before the analyser
+ * can see it: the odd generation is published last.
+ */
+static amd_shm_session_t *amd_shm_open(uint32_t rate, const char *uuid, uint32_t *generation)
+{
+    amd_shm_arena_t *arena = amd.audio_shm;
+    uint32_t i, start;
+
+    if (!arena) {
+        return NULL;
+    }
+
+    start = (uint32_t)atomic_fetch_add_explicit(&amd.audio_shm_next, 1, memory_order_relaxed);
+
+    for (i = 0; i < arena->sessions; i++) {
+        uint32_t idx = (start + i) % arena->sessions;
+        amd_shm_session_t *ss = &arena->session[idx];
+        uint_fast32_t g;
+
+        if (atomic_load_explicit(&amd.audio_shm_owned[idx], memory_order_relaxed) ||
+            atomic_exchange_explicit(&amd.audio_shm_owned[idx], 1, memory_order_acquire)) {
+            continue;
+        }
+
+        g = atomic_load_explicit(&ss->generation, memory_order_relaxed);
+        ss->rate = rate;
+        switch_copy_string(ss->uuid, uuid, sizeof(ss->uuid));
+        atomic_store_explicit(&ss->tail, 0, memory_order_relaxed);
+        atomic_store_explicit(&ss->head, 0, memory_order_relaxed);
+        atomic_store_explicit(&ss->generation, g + 1, memory_order_release);
+        *generation = (uint32_t)(g + 1);
+        amd_shm_doorbell();
+        return ss;
+    }
+
+    return NULL;
+}
+
+static void amd_shm_close(amd_shm_session_t *ss, uint32_t generation)
+{
+    atomic_store_explicit(&ss->generation, generation + 1, memory_order_release);
+    atomic_store_explicit(&amd.audio_shm_owned[ss - amd.audio_shm->session], 0, memory_order_release);
+    amd_shm_doorbell();
+}
+
+/* One memcpy per frame and no syscall unless the analyser is asleep */
+static void amd_shm_push(amd_shm_session_t *ss, const int16_t *data, uint32_t samples)
+{
+    do {
+        uint32_t n = samples > AMD_EXT_MAX_SAMPLES ? AMD_EXT_MAX_SAMPLES : samples;
+        uint64_t head = atomic_load_explicit(&ss->head, memory_order_relaxed);
+        amd_shm_frame_t *fr;
+
+        if (head - atomic_load_explicit(&ss->tail, memory_order_acquire) >= AMD_SHM_RING_FRAMES) {
+            atomic_fetch_add_explicit(&amd.audio_shm->dropped, 1, memory_order_relaxed);
+            return;
+        }
+
+        fr = &ss->frames[head % AMD_SHM_RING_FRAMES];
+        fr->samples = n;
+        memcpy(fr->data, data, n * sizeof(int16_t));
+        atomic_store_explicit(&ss->head, head + 1, memory_order_release);
+
+        data += n;
+        samples -= n;
+    } while (samples);
+
+    amd_shm_doorbell();
+}
+
+/* -------------------------
+   Selective audio capture
+   ------------------------- */
+
+/*
+ * Calls that fall in the capture_rate sample (decided at start) and whose verdict
+ * is in capture_results hand their ring of analysed audio to one writer
+ * thread, which writes a WAV per call. Each file goes out as a single aligned
+ * write, with O_DIRECT where the filesystem supports it, and is then truncated
+ * to its real length.
+ */
+static void amd_put_le(uint8_t *p, uint32_t v, int bytes)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void amd_capture_write(const amd_capture_t *job)
+{
+    char path[1024];
+    size_t data = (size_t)job->samples * sizeof(int16_t), total = 44 + data;
+    size_t head = (size_t)(job->size - job->first) * sizeof(int16_t);
+    size_t padded = (total + AMD_CAPTURE_ALIGN - 1) & ~(size_t)(AMD_CAPTURE_ALIGN - 1), off = 0;
+    uint8_t *buf = NULL;
+    int fd = -1;
+
+    if (posix_memalign((void **)&buf, AMD_CAPTURE_ALIGN, padded)) {
+        return;
+    }
+
+    memcpy(buf, "RIFF", 4);
+    amd_put_le(buf + 4, (uint32_t)(total - 8), 4);
+    memcpy(buf + 8, "WAVEfmt ", 8);
+    amd_put_le(buf + 16, 16, 4);
+    amd_put_le(buf + 20, 1, 2);                     /* PCM */
+    amd_put_le(buf + 22, 1, 2);                     /* mono */
+    amd_put_le(buf + 24, job->rate, 4);
+    amd_put_le(buf + 28, job->rate * 2, 4);
+    amd_put_le(buf + 32, 2, 2);
+    amd_put_le(buf + 34, 16, 2);
+    memcpy(buf + 36, "data", 4);
+    amd_put_le(buf + 40, (uint32_t)data, 4);
+    if (head > data) {
+        head = data;
+    }
+    memcpy(buf + 44, job->pcm + job->first, head);
+    memcpy(buf + 44 + head, job->pcm, data - head);
+    memset(buf + total, 0, padded - total);
+
+    switch_snprintf(path, sizeof(path), "%s%s%s-r%u-%s-%s.wav", amd.capture_dir, SWITCH_PATH_SEPARATOR,
+                    job->uuid, job->round, job->result, job->cause);
+
+#ifdef O_DIRECT
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+#endif
+    if (fd < 0) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot create %s: %s\n", path, strerror(errno));
+        free(buf);
+        return;
+    }
+
+    while (off < padded) {
+        ssize_t n = write(fd, buf + off, padded - off);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Write to %s failed: %s\n", path, strerror(errno));
+            break;
+        }
+        off += (size_t)n;
+    }
+    if (ftruncate(fd, (off_t)total)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot trim %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+    free(buf);
+
+    atomic_fetch_add(&amd.capture_written, 1);
+}
+
+static void *SWITCH_THREAD_FUNC amd_capture_run(switch_thread_t *thread, void *obj)
+{
+    (void)thread;
+    (void)obj;
+
+    for (;;) {
+        amd_capture_t **slot;
+        int running = atomic_load(&amd.running);
+
+        /* Drain everything queued since the last pass; after shutdown is signalled, drain once more and stop */
+        while ((slot = amd_ring_peek(&amd.capture_ring))) {
+            amd_capture_t *job = *slot;
+
+            amd_ring_release(&amd.capture_ring);
+            amd_capture_write(job);
+            free(job);
+        }
+
+        if (!running) {
+            break;
+        }
+        switch_yield(100000);
+    }
+
+    return NULL;
+}
+
+static void amd_capture_init(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    if (zstr(amd.capture_dir)) {
+        return;
+    }
+
+    if (switch_dir_make_recursive(amd.capture_dir, SWITCH_DEFAULT_DIR_PERMS, amd.pool) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot create capture_dir %s; capture disabled\n", amd.capture_dir);
+        return;
+    }
+
+    amd_ring_init(&amd.capture_ring, amd.pool, amd.capture_queue ? amd.capture_queue : 64, sizeof(amd_capture_t *));
+
+    switch_threadattr_create(&thd_attr, amd.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&amd.capture_thread, thd_attr, amd_capture_run, NULL, amd.pool);
+}
+
+/* Whole-word, case-insensitive membership in a comma-separated list */
+static switch_bool_t amd_list_has(const char *list, const char *item)
+{
+    size_t len = strlen(item);
+
+    while (list && *list) {
+        while (*list == ',' || *list == ' ') list++;
+        if (!strncasecmp(list, item, len) && (list[len] == ',' || list[len] == ' ' || !list[len])) {
+            return SWITCH_TRUE;
+        }
+        list = strchr(list, ',');
+    }
+
+    return SWITCH_FALSE;
+}
+
+/* -------------------------
+   Decision log
+   ------------------------- */
+
+/*
+ * One JSON line per verdict. The call thread formats the record directly
+ * into a claimed queue cell, so logging costs it a snprintf and never a
+ * syscall; one writer thread drains the queue in batches of up to
+ * AMD_LOG_BATCH with a single write() and fdatasync() each, and rotates
+ * decision_log to .1 ... .N once it passes decision_log_max_size MB.
+ * A full queue drops the record and counts it.
+ */
+static uint64_t amd_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Copy a string into a JSON string body, escaping quotes, backslashes and control characters */
+static void amd_json_escape(char *out, size_t len, const char *in)
+{
+    size_t used = 0;
+
+    for (; in && *in && used + 7 < len; in++) {
+        unsigned char c = (unsigned char)*in;
+
+        if (c == '"' || c == '\\') {
+            out[used++] = '\\';
+            out[used++] = (char)c;
+        } else if (c < 0x20) {
+            used += (size_t)switch_snprintf(out + used, len - used, "\\u%04x", c);
+        } else {
+            out[used++] = (char)c;
+        }
+    }
+    out[used] = '\0';
+}
+
+static int amd_log_open(off_t *size)
+{
+    struct stat st;
+    int fd = open(amd.decision_log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Cannot open %s: %s\n", amd.decision_log, strerror(errno));
+        return -1;
+    }
+    *size = fstat(fd, &st) ? 0 : st.st_size;
+
+    return fd;
+}
+
+/* path.N-1 -> path.N, ..., path -> path.1; the oldest falls off the end */
+static void amd_log_rotate(void)
+{
+    char from[1024], to[1024];
+    uint32_t i;
+
+    for (i = amd.decision_log_files; i > 0; i--) {
+        if (i > 1) {
+            switch_snprintf(from, sizeof(from), "%s.%u", amd.decision_log, i - 1);
+        } else {
+            switch_copy_string(from, amd.decision_log, sizeof(from));
+        }
+        switch_snprintf(to, sizeof(to), "%s.%u", amd.decision_log, i);
+        rename(from, to);
+    }
+    if (!amd.decision_log_files) {
+        unlink(amd.decision_log);
+    }
+}
+
+static void amd_log_flush(int *fd, off_t *size, const char *buf, size_t len)
+{
+    size_t off = 0;
+
+    if (*fd < 0 && (*fd = amd_log_open(size)) < 0) {
+        return;
+    }
+
+    while (off < len) {
+        ssize_t n = write(*fd, buf + off, len - off);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Write to %s failed: %s\n", amd.decision_log, strerror(errno));
+            break;
+        }
+        off += (size_t)n;
+    }
+    fdatasync(*fd);
+    *size += (off_t)off;
+
+    if (amd.decision_log_max_size && *size >= (off_t)amd.decision_log_max_size * 1024 * 1024) {
+        close(*fd);
+        amd_log_rotate();
+        *fd = amd_log_open(size);
+    }
+}
+
+static void *SWITCH_THREAD_FUNC amd_log_run(switch_thread_t *thread, void *obj)
+{
+    char *buf = malloc(AMD_LOG_BATCH);
+    uint64_t dropped = 0;
+    off_t size = 0;
+    int fd = -1;
+
+    (void)thread;
+    (void)obj;
+
+    if (!buf) {
+        return NULL;
+    }
+
+    for (;;) {
+        amd_log_record_t *rec;
+        int running = atomic_load(&amd.running);
+        size_t used = 0;
+        uint64_t records = 0, now_dropped;
+
+        /* Drain in batches; after shutdown is signalled, drain once more and stop */
+        while ((rec = amd_ring_peek(&amd.log_ring))) {
+            if (used + rec->len > AMD_LOG_BATCH) {
+                amd_log_flush(&fd, &size, buf, used);
+                used = 0;
+            }
+            memcpy(buf + used, rec->line, rec->len);
+            used += rec->len;
+            records++;
+            amd_ring_release(&amd.log_ring);
+        }
+        if (used) {
+            amd_log_flush(&fd, &size, buf, used);
+            atomic_fetch_add(&amd.log_written, records);
+        }
+
+        if ((now_dropped = atomic_load(&amd.log_dropped)) != dropped) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Decision log queue full; %llu record(s) dropped\n",
+                              (unsigned long long)(now_dropped - dropped));
+            dropped = now_dropped;
+        }
+
+        if (!running) {
+            break;
+        }
+        switch_yield(100000);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+static void amd_log_init(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    if (zstr(amd.decision_log)) {
+        return;
+    }
+
+    amd_ring_init(&amd.log_ring, amd.pool, amd.decision_log_queue ? amd.decision_log_queue : 4096, sizeof(amd_log_record_t));
+
+    switch_threadattr_create(&thd_attr, amd.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&amd.log_thread, thd_attr, amd_log_run, NULL, amd.pool);
+}
+
+/* -------------------------
+   Metrics
+   ------------------------- */
+
+/*
+ * Media threads update counters in one of AMD_STATS_SHARDS shards, picked
+ * once per thread, with relaxed atomic adds; a thread never touches a line
+ * another busy thread is writing unless there are more media threads than
+ * shards. The stats thread sums the shards and reports the change since its
+ * previous pass, so the media path never aggregates or formats anything.
+ */
+static const char *amd_stats_results[AMD_STATS_RESULTS] = { "MACHINE", "HUMAN", "NOTSURE" };
+static const char *amd_stats_causes[AMD_STATS_CAUSES] = {
+    "INITIALSILENCE", "SILENCEAFTERGREETING", "MAXWORDLENGTH", "MAXWORDS", "LONGGREETING",
+    "TOOLONG", "ANSWERED", "TALKOVER", "DTMF", "OVERLOAD", "CAPACITY", "CPUBUDGET", "OTHER"
+};
+
+static amd_stats_shard_t *amd_stats_shard(void)
+{
+    static _Thread_local amd_stats_shard_t *shard;
+
+    if (!shard) {
+        shard = &amd.stats[atomic_fetch_add_explicit(&amd.stats_next_shard, 1, memory_order_relaxed) % AMD_STATS_SHARDS];
+    }
+
+    return shard;
+}
+
+static void amd_stats_add(atomic_uint_fast64_t *counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/* Index into amd_stats_results; anything unexpected counts as NOTSURE */
+static uint32_t amd_stats_result(const char *result)
+{
+    uint32_t r;
+
+    for (r = 0; r < AMD_STATS_RESULTS - 1 && strcmp(result, amd_stats_results[r]); r++);
+
+    return r;
+}
+
+static void amd_stats_decision(const char *result, const char *cause, uint32_t decision_ms)
+{
+    amd_stats_shard_t *shard = amd_stats_shard();
+    uint32_t r = amd_stats_result(result), c, bucket = decision_ms / 100;
+
+    for (c = 0; c < AMD_STATS_CAUSES - 1 && strcmp(cause, amd_stats_causes[c]); c++);
+
+    amd_stats_add(&shard->decisions[r][c], 1);
+    amd_stats_add(&shard->decision_ms[bucket < AMD_STATS_BUCKETS ? bucket : AMD_STATS_BUCKETS - 1], 1);
+}
+
+static void amd_stats_collect(amd_stats_t *out)
+{
+    uint32_t i, r, c;
+
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < AMD_STATS_SHARDS; i++) {
+        amd_stats_shard_t *shard = &amd.stats[i];
+
+        for (r = 0; r < AMD_STATS_RESULTS; r++) {
+            for (c = 0; c < AMD_STATS_CAUSES; c++) {
+                out->decisions[r][c] += atomic_load_explicit(&shard->decisions[r][c], memory_order_relaxed);
+            }
+        }
+        for (r = 0; r < AMD_STATS_BUCKETS; r++) {
+            out->decision_ms[r] += atomic_load_explicit(&shard->decision_ms[r], memory_order_relaxed);
+        }
+        out->started += atomic_load_explicit(&shard->started, memory_order_relaxed);
+        out->stopped += atomic_load_explicit(&shard->stopped, memory_order_relaxed);
+        out->frames += atomic_load_explicit(&shard->frames, memory_order_relaxed);
+        out->cpu_ns += atomic_load_explicit(&shard->cpu_ns, memory_order_relaxed);
+    }
+    out->overload_transitions = atomic_load(&amd.overload_transitions);
+    out->overload_tier = atomic_load(&amd.overload_tier);
+    out->rates_full = atomic_load(&amd.rates_full);
+    out->admission_unchecked = atomic_load(&amd.admission_unchecked);
+    out->lite_sessions = atomic_load(&amd.lite_sessions);
+}
+
+/* Lowercase copy for metric names and tag values */
+static const char *amd_stats_lower(const char *in, char *out, size_t len)
+{
+    size_t i;
+
+    for (i = 0; in[i] && i + 1 < len; i++) {
+        out[i] = (char)tolower((unsigned char)in[i]);
+    }
+    out[i] = '\0';
+
+    return out;
+}
+
+static int amd_statsd_connect(void)
+{
+    struct addrinfo hints = { 0 }, *res = NULL, *ai;
+    char host[256], *port;
+    int fd = -1;
+
+    switch_copy_string(host, amd.statsd_endpoint, sizeof(host));
+    if ((port = strrchr(host, ':'))) {
+        *port++ = '\0';
+    } else {
+        port = "8125";
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &res)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AMD: Cannot resolve statsd_endpoint %s\n", amd.statsd_endpoint);
+        return -1;
+    }
+
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    return fd;
+}
+
+typedef struct {
+    int fd;
+    switch_bool_t dog;
+    char buf[AMD_STATS_PACKET];
+    size_t used;
+} amd_statsd_batch_t;
+
+/* Append one metric line, sending the datagram first if the line would not fit. UDP loss is accepted. */
+static void amd_statsd_put(amd_statsd_batch_t *b, const char *line, size_t len)
+{
+    if (b->used && b->used + 1 + len > AMD_STATS_PACKET) {
+        if (send(b->fd, b->buf, b->used, 0) < 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AMD: statsd send failed: %s\n", strerror(errno));
+        }
+        b->used = 0;
+    }
+    if (b->used) {
+        b->buf[b->used++] = '\n';
+    }
+    memcpy(b->buf + b->used, line, len);
+    b->used += len;
+}
+
+/*
+ * One metric line. suffix is appended to the name, except in DogStatsD
+ * format when tags are given, where the tags carry the same information.
+ */
+static void amd_statsd_metric(amd_statsd_batch_t *b, const char *name, const char *suffix, uint64_t value,
+                              const char *type, double rate, const char *tags)
+{
+    char line[512], rate_s[32] = "";
+    int n;
+
+    if (b->dog && !zstr(tags)) {
+        suffix = NULL;
+    }
+
+    if (rate < 1.0) {
+        switch_snprintf(rate_s, sizeof(rate_s), "|@%.6g", rate);
+    }
+
+    if (b->dog) {
+        const char *sep = !zstr(tags) && !zstr(amd.statsd_tags) ? "," : "";
+
+        n = switch_snprintf(line, sizeof(line), "%s.%s%s%s:%llu|%s%s%s%s%s%s", amd.statsd_prefix, name,
+                            zstr(suffix) ? "" : ".", zstr(suffix) ? "" : suffix, (unsigned long long)value, type, rate_s, !zstr(tags) || !zstr(amd.statsd_tags) ? "|#" : "",
+                            zstr(tags) ? "" : tags, sep, zstr(amd.statsd_tags) ? "" : amd.statsd_tags);
+    } else {
+        n = switch_snprintf(line, sizeof(line), "%s.%s%s%s:%llu|%s%s", amd.statsd_prefix, name,
+                            zstr(suffix) ? "" : ".", zstr(suffix) ? "" : suffix, (unsigned long long)value, type, rate_s);
+    }
+    if (n > 0 && (size_t)n < sizeof(line)) {
+        amd_statsd_put(b, line, (size_t)n);
+    }
+}
+
+/* Smallest bucket upper bound covering pct percent of a time-to-decision histogram (now - prev, if given) */
+static uint32_t amd_stats_percentile(const uint64_t *now, const uint64_t *prev, uint64_t total, uint32_t pct)
+{
+    uint64_t seen = 0, want = (total * pct + 99) / 100;
+    uint32_t i;
+
+    for (i = 0; i < AMD_STATS_BUCKETS; i++) {
+        seen += now[i] - (prev ? prev[i] : 0);
+        if (seen >= want) {
+            break;
+        }
+    }
+
+    return (i < AMD_STATS_BUCKETS ? i + 1 : AMD_STATS_BUCKETS) * 100;
+}
+
+/* Push the change between two snapshots as one or more datagrams */
+static void amd_statsd_report(int fd, const amd_stats_t *now, const amd_stats_t *prev)
+{
+    amd_statsd_batch_t b;
+    uint64_t frames = now->frames - prev->frames;
+    uint32_t r, c, i;
+
+    b.fd = fd;
+    b.dog = !strcasecmp(amd.statsd_format, "dogstatsd");
+    b.used = 0;
+
+    for (r = 0; r < AMD_STATS_RESULTS; r++) {
+        for (c = 0; c < AMD_STATS_CAUSES; c++) {
+            uint64_t n = now->decisions[r][c] - prev->decisions[r][c];
+            char result[16], cause[32], name[64], tags[96];
+
+            if (!n) {
+                continue;
+            }
+            amd_stats_lower(amd_stats_results[r], result, sizeof(result));
+            amd_stats_lower(amd_stats_causes[c], cause, sizeof(cause));
+            switch_snprintf(name, sizeof(name), "%s.%s", result, cause);
+            switch_snprintf(tags, sizeof(tags), "result:%s,cause:%s", result, cause);
+            amd_statsd_metric(&b, "decisions", name, n, "c", 1.0, tags);
+        }
+    }
+
+    /*
+     * DogStatsD weights a sampled timing by its rate, so the histogram goes out
+     * as one timing per bucket: value = bucket middle, rate = 1/count. Plain
+     * StatsD only scales the count by the rate, which would weigh every bucket
+     * alike, so it gets the interval's percentiles as gauges instead.
+     */
+    if (b.dog) {
+        for (i = 0; i < AMD_STATS_BUCKETS; i++) {
+            uint64_t n = now->decision_ms[i] - prev->decision_ms[i];
+
+            if (n) {
+                amd_statsd_metric(&b, "decision_time", NULL, i * 100 + 50, "ms", 1.0 / (double)n, NULL);
+            }
+        }
+    } else {
+        uint64_t total = 0;
+
+        for (i = 0; i < AMD_STATS_BUCKETS; i++) {
+            total += now->decision_ms[i] - prev->decision_ms[i];
+        }
+        if (total) {
+            amd_statsd_metric(&b, "decision_time", "p50", amd_stats_percentile(now->decision_ms, prev->decision_ms, total, 50), "g", 1.0, NULL);
+            amd_statsd_metric(&b, "decision_time", "p90", amd_stats_percentile(now->decision_ms, prev->decision_ms, total, 90), "g", 1.0, NULL);
+            amd_statsd_metric(&b, "decision_time", "p99", amd_stats_percentile(now->decision_ms, prev->decision_ms, total, 99), "g", 1.0, NULL);
+        }
+    }
+
+    amd_statsd_metric(&b, "sessions", "active", now->started - now->stopped, "g", 1.0, NULL);
+    if (now->started != prev->started) {
+        amd_statsd_metric(&b, "sessions", "started", now->started - prev->started, "c", 1.0, NULL);
+    }
+    amd_statsd_metric(&b, "sessions", "lite", now->lite_sessions, "g", 1.0, NULL);
+    if (now->admission_unchecked != prev->admission_unchecked) {
+        amd_statsd_metric(&b, "admission", "unchecked", now->admission_unchecked - prev->admission_unchecked, "c", 1.0, NULL);
+    }
+    amd_statsd_metric(&b, "overload", "tier", now->overload_tier, "g", 1.0, NULL);
+    if (now->overload_transitions != prev->overload_transitions) {
+        amd_statsd_metric(&b, "overload", "transitions", now->overload_transitions - prev->overload_transitions, "c", 1.0, NULL);
+    }
+    if (now->rates_full != prev->rates_full) {
+        amd_statsd_metric(&b, "rates", "full", now->rates_full - prev->rates_full, "c", 1.0, NULL);
+    }
+    if (frames) {
+        amd_statsd_metric(&b, "frames", NULL, frames, "c", 1.0, NULL);
+        amd_statsd_metric(&b, "frame_ns", NULL, (now->cpu_ns - prev->cpu_ns) / frames, "g", 1.0, NULL);
+    }
+
+    if (b.used && send(fd, b.buf, b.used, 0) < 0) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AMD: statsd send failed: %s\n", strerror(errno));
+    }
+}
+
+/* amd::stats heartbeat: per-interval counts and latency percentiles for cluster-wide collection */
+static void amd_stats_event(const amd_stats_t *now, const amd_stats_t *prev, uint32_t interval_ms)
+{
+    switch_event_t *event = NULL;
+    uint64_t per_result[AMD_STATS_RESULTS] = { 0 }, total = 0;
+    uint64_t frames = now->frames - prev->frames;
+    uint32_t r, c;
+
+    for (r = 0; r < AMD_STATS_RESULTS; r++) {
+        for (c = 0; c < AMD_STATS_CAUSES; c++) {
+            per_result[r] += now->decisions[r][c] - prev->decisions[r][c];
+        }
+        total += per_result[r];
+    }
+
+    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, AMD_EVENT_STATS) != SWITCH_STATUS_SUCCESS) {
+        return;
+    }
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Interval-Ms", "%u", interval_ms);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Decisions", "%llu", (unsigned long long)total);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Machine", "%llu", (unsigned long long)per_result[0]);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Human", "%llu", (unsigned long long)per_result[1]);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-NotSure", "%llu", (unsigned long long)per_result[2]);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Machine-Rate", "%.3f",
+                            total ? (double)per_result[0] / (double)total : 0.0);
+    if (total) {
+        switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Decision-Ms-P50", "%u", amd_stats_percentile(now->decision_ms, prev->decision_ms, total, 50));
+        switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Decision-Ms-P90", "%u", amd_stats_percentile(now->decision_ms, prev->decision_ms, total, 90));
+        switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Decision-Ms-P99", "%u", amd_stats_percentile(now->decision_ms, prev->decision_ms, total, 99));
+    }
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Sessions-Active", "%llu", (unsigned long long)(now->started - now->stopped));
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Sessions-Started", "%llu", (unsigned long long)(now->started - prev->started));
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Sessions-Lite", "%u", now->lite_sessions);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Admission-Unchecked", "%llu",
+                            (unsigned long long)(now->admission_unchecked - prev->admission_unchecked));
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Frames", "%llu", (unsigned long long)frames);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Overload-Tier", "%u", now->overload_tier);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Frame-Ns", "%llu",
+                            (unsigned long long)(frames ? (now->cpu_ns - prev->cpu_ns) / frames : 0));
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Rates-Full", "%llu", (unsigned long long)(now->rates_full - prev->rates_full));
+    switch_event_fire(&event);
+}
+
+/*
+ * Overload tiers, re-evaluated every second from idle CPU and from the
+ * average cost of an analysed AMD frame over that second:
+ *   1  optional stages off: echo canceller, inband DTMF, progress events, capture
+ *   2  also analyse one frame in AMD_OVERLOAD_STRIDE
+ *   3  also refuse new starts with NOTSURE/OVERLOAD
+ * A tier is entered when a threshold is crossed and left only once the
+ * metric is 5 idle points (or 20% ns) back on the good side and the tier
+ * has been held for overload_dwell seconds. Shedding lowers the very cost
+ * ns/frame measures, so without the dwell a node near a threshold would
+ * flap between tiers every second.
+ */
+static uint32_t amd_overload_tier(void)
+{
+    return atomic_load_explicit(&amd.overload_tier, memory_order_relaxed);
+}
+
+/* Tiers indicated by the thresholds; worse means below (idle) or above (ns) the threshold */
+static uint32_t amd_overload_level(amd_overload_th_t *th, double value, switch_bool_t below, double slack)
+{
+    uint32_t n = atomic_load_explicit(&th->count, memory_order_acquire), i, level = 0;
+
+    for (i = 0; i < n && i < AMD_OVERLOAD_TIERS; i++) {
+        double at = (double)atomic_load_explicit(&th->at[i], memory_order_relaxed);
+
+        if (below ? value < at + slack : value > at * (1.0 - slack)) {
+            level = i + 1;
+        }
+    }
+
+    return level;
+}
+
+static void amd_overload_update(const amd_stats_t *now, const amd_stats_t *prev, uint64_t *since)
+{
+    uint64_t frames = now->frames - prev->frames, t = amd_now_ns();
+    double idle = atomic_load(&amd.overload_idle_th.count) ? switch_core_idle_cpu() : 100.0;
+    double ns = frames ? (double)(now->cpu_ns - prev->cpu_ns) / (double)frames : 0.0;
+    uint32_t up, down, cur = amd_overload_tier(), next = cur;
+
+    up = amd_overload_level(&amd.overload_idle_th, idle, SWITCH_TRUE, 0.0);
+    if (amd_overload_level(&amd.overload_ns_th, ns, SWITCH_FALSE, 0.0) > up) {
+        up = amd_overload_level(&amd.overload_ns_th, ns, SWITCH_FALSE, 0.0);
+    }
+    down = amd_overload_level(&amd.overload_idle_th, idle, SWITCH_TRUE, 5.0);
+    if (amd_overload_level(&amd.overload_ns_th, ns, SWITCH_FALSE, 0.2) > down) {
+        down = amd_overload_level(&amd.overload_ns_th, ns, SWITCH_FALSE, 0.2);
+    }
+
+    if (up > cur) {
+        next = up;
+    } else if (down < cur && t - *since >= (uint64_t)amd.overload_dwell * 1000000000ULL) {
+        next = down;
+    }
+
+    if (next != cur) {
+        *since = t;
+        atomic_store(&amd.overload_tier, next);
+        atomic_fetch_add(&amd.overload_transitions, 1);
+        switch_log_printf(SWITCH_CHANNEL_LOG, next > cur ? SWITCH_LOG_WARNING : SWITCH_LOG_NOTICE,
+                          "AMD: Overload tier %u -> %u (idle %.1f%%, %.0f ns/frame)\n", cur, next, idle, ns);
+    }
+}
+
+/* StatsD pushes, amd::stats events and overload tiers, each on its own interval and with its own baseline */
+static void *SWITCH_THREAD_FUNC amd_stats_run(switch_thread_t *thread, void *obj)
+{
+    amd_stats_t now, statsd_prev, event_prev, overload_prev;
+    uint64_t statsd_at = amd_now_ns(), event_at = statsd_at, overload_at = statsd_at, overload_since = statsd_at;
+    int fd = zstr(amd.statsd_endpoint) ? -1 : amd_statsd_connect();
+
+    (void)thread;
+    (void)obj;
+
+    amd_stats_collect(&statsd_prev);
+    event_prev = overload_prev = statsd_prev;
+
+    for (;;) {
+        int running = atomic_load(&amd.running);
+        uint64_t t = amd_now_ns();
+
+        if (t - overload_at >= 1000000000ULL) {
+            amd_stats_collect(&now);
+            amd_overload_update(&now, &overload_prev, &overload_since);
+            overload_prev = now;
+            overload_at = t;
+        }
+
+        /* Report on schedule, and once more on shutdown */
+        if (!running || t - statsd_at >= (uint64_t)(amd.statsd_interval ? amd.statsd_interval : 10) * 1000000000ULL) {
+            amd_stats_collect(&now);
+            if (fd >= 0) {
+                amd_statsd_report(fd, &now, &statsd_prev);
+            }
+            statsd_prev = now;
+            statsd_at = t;
+        }
+
+        if (!amd.stats_interval) {
+            event_at = t;
+        } else if (running && t - event_at >= (uint64_t)amd.stats_interval * 1000000000ULL) {
+            amd_stats_collect(&now);
+            amd_stats_event(&now, &event_prev, (uint32_t)((t - event_at) / 1000000));
+            event_prev = now;
+            event_at = t;
+        }
+
+        if (!running) {
+            break;
+        }
+        switch_yield(100000);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void amd_stats_init(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    /* Always started: stats_interval can be turned on by a reload */
+    switch_threadattr_create(&thd_attr, amd.pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&amd.stats_thread, thd_attr, amd_stats_run, NULL, amd.pool);
+}
+
+/* -------------------------
+   Campaign and gateway rates
+   ------------------------- */
+
+/*
+ * Live MACHINE/HUMAN/NOTSURE counts per campaign (campaign_variable) and
+ * per gateway (sip_gateway_name) over the last rates_window seconds, for
+ * predictive dialers. Keys live in a fixed open-addressed table claimed
+ * with CAS and resolved once when AMD starts; a verdict is one CAS on the
+ * current second's bucket. Reading a window walks its buckets.
+ *
+ * Sessions pin their keys until the bug closes. The housekeeping thread
+ * evicts unpinned keys with no traffic for a whole window (AMD_RATE_IDLE
+ * seconds when rates_window is 0), leaving a tombstone so probe chains
+ * stay intact; the next new key reuses it.
+ */
+#define AMD_RATE_STAMP(v) ((uint32_t)((v) >> 36))
+#define AMD_RATE_COUNT(v, r) ((uint32_t)((v) >> (24 - 12 * (r))) & AMD_RATE_COUNT_MAX)
+#define AMD_RATE_FREED (1)
+#define AMD_RATE_BUSY (2)
+#define AMD_RATE_RESERVED (3)       /* hashes below this are slot states */
+#define AMD_RATE_IDLE (900)
+
+static uint32_t amd_rates_now(void)
+{
+    return (uint32_t)(amd_now_ns() / 1000000000ULL) & 0xfffffff;
+}
+
+static void amd_rates_init(void)
+{
+    uint32_t i;
+    atomic_uint_fast64_t *buckets = NULL;
+
+    if (!amd.rates_keys) {
+        return;
+    }
+
+    /* Zeroed pool memory; the quality counters need no further setup */
+    amd.rate_keys = switch_core_alloc(amd.pool, sizeof(amd_rate_key_t) * amd.rates_keys);
+    if (amd.rates_window) {
+        buckets = switch_core_alloc(amd.pool, sizeof(*buckets) * amd.rates_keys * amd.rates_window);
+    }
+    for (i = 0; i < amd.rates_keys; i++) {
+        atomic_init(&amd.rate_keys[i].hash, 0);
+        atomic_init(&amd.rate_keys[i].ready, 0);
+        amd.rate_keys[i].buckets = buckets ? buckets + (size_t)i * amd.rates_window : NULL;
+    }
+}
+
+/*
+ * Find the key; NULL if absent or the table is full. With create set a
+ * missing key claims the first free or evicted slot on its chain, and the
+ * key is pinned: the caller gives it back with amd_rates_unpin().
+ */
+static amd_rate_key_t *amd_rates_key(char kind, const char *name, switch_bool_t create)
+{
+    char key[AMD_RATE_NAME_LEN + 2];
+    uint64_t hash;
+    uint32_t i;
+
+    if (!amd.rate_keys || zstr(name)) {
+        return NULL;
+    }
+
+    switch_snprintf(key, sizeof(key), "%c:%s", kind, name);
+    if ((hash = amd_cache_hash(key)) < AMD_RATE_RESERVED) {
+        hash += AMD_RATE_RESERVED;
+    }
+
+    for (;;) {
+        amd_rate_key_t *spare = NULL;
+        uint_fast64_t expect = 0;
+        switch_bool_t settle = SWITCH_FALSE;
+
+        for (i = 0; i < amd.rates_keys; i++) {
+            amd_rate_key_t *k = &amd.rate_keys[(hash + i) % amd.rates_keys];
+            uint_fast64_t cur = atomic_load_explicit(&k->hash, memory_order_acquire);
+
+            if (cur == hash) {
+                if (!create) {
+                    return k;
+                }
+                /* Pin, then make sure the evictor did not take the slot in between */
+                atomic_fetch_add(&k->refs, 1);
+                if (atomic_load(&k->hash) == hash) {
+                    atomic_store_explicit(&k->last, amd_rates_now(), memory_order_relaxed);
+                    return k;
+                }
+                atomic_fetch_sub(&k->refs, 1);
+                settle = SWITCH_TRUE;
+                break;
+            }
+            if (cur == AMD_RATE_BUSY) {
+                settle = SWITCH_TRUE;
+                break;
+            }
+            if (cur <= AMD_RATE_FREED && !spare) {
+                spare = k;
+                expect = cur;
+            }
+            if (!cur) {
+                break;
+            }
+        }
+
+        if (settle) {
+            /* A slot on the chain is mid-claim or mid-eviction; look again once it settles */
+            switch_cond_next();
+            continue;
+        }
+        if (!create) {
+            return NULL;
+        }
+        if (!spare) {
+            atomic_fetch_add(&amd.rates_full, 1);
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong(&spare->hash, &expect, AMD_RATE_BUSY)) {
+            spare->kind = kind;
+            switch_copy_string(spare->name, name, sizeof(spare->name));
+            atomic_store(&spare->refs, 1);
+            atomic_store_explicit(&spare->last, amd_rates_now(), memory_order_relaxed);
+            atomic_store_explicit(&spare->hash, hash, memory_order_release);
+            atomic_store_explicit(&spare->ready, 1, memory_order_release);
+            return spare;
+        }
+        /* Lost the slot to another claim, possibly of the same key */
+    }
+}
+
+static void amd_rates_unpin(amd_rate_key_t *k)
+{
+    if (k) {
+        atomic_fetch_sub(&k->refs, 1);
+    }
+}
+
+/* Tombstone unpinned keys idle for a whole window; runs once a second on the housekeeping thread */
+static void amd_rates_evict(void)
+{
+    uint32_t now = amd_rates_now(), idle = amd.rates_window ? amd.rates_window : AMD_RATE_IDLE, i, j;
+
+    for (i = 0; i < amd.rates_keys; i++) {
+        amd_rate_key_t *k = &amd.rate_keys[i];
+        uint_fast64_t cur = atomic_load_explicit(&k->hash, memory_order_acquire);
+
+        if (cur < AMD_RATE_RESERVED || atomic_load(&k->refs) ||
+            ((now - atomic_load_explicit(&k->last, memory_order_relaxed)) & 0xfffffff) < idle) {
+            continue;
+        }
+        if (!atomic_compare_exchange_strong(&k->hash, &cur, AMD_RATE_BUSY)) {
+            continue;
+        }
+        /* Pairs with the pin in amd_rates_key: one of the two sees the other */
+        if (atomic_load(&k->refs)) {
+            atomic_store(&k->hash, cur);
+            continue;
+        }
+
+        atomic_store(&k->ready, 0);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AMD: Evicting idle %s [%s] from the rates table\n",
+                          k->kind == 'c' ? "campaign" : "gateway", k->name);
+        for (j = 0; k->buckets && j < amd.rates_window; j++) {
+            atomic_store_explicit(&k->buckets[j], 0, memory_order_relaxed);
+        }
+        for (j = 0; j < AMD_STATS_BUCKETS; j++) {
+            atomic_store_explicit(&k->decision_ms[j], 0, memory_order_relaxed);
+        }
+        atomic_store(&k->active, 0);
+        atomic_store(&k->calls, 0);
+        atomic_store(&k->noaudio, 0);
+        atomic_store(&k->notsure, 0);
+        atomic_store(&k->toolong, 0);
+        atomic_store(&k->noise_sum, 0);
+        atomic_store(&k->noise_calls, 0);
+        atomic_fetch_add(&amd.rates_evicted, 1);
+        atomic_store_explicit(&k->hash, AMD_RATE_FREED, memory_order_release);
+    }
+}
+
+static void amd_rates_add(amd_rate_key_t *k, uint32_t r)
+{
+    uint32_t now = amd_rates_now();
+    atomic_uint_fast64_t *b;
+    uint_fast64_t old, val;
+
+    if (!k->buckets) {
+        return;
+    }
+    atomic_store_explicit(&k->last, now, memory_order_relaxed);
+    b = &k->buckets[now % amd.rates_window];
+    old = atomic_load_explicit(b, memory_order_relaxed);
+
+    do {
+        val = AMD_RATE_STAMP(old) == now ? old : (uint64_t)now << 36;
+        if (AMD_RATE_COUNT(val, r) < AMD_RATE_COUNT_MAX) {
+            val += (uint64_t)1 << (24 - 12 * r);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(b, &old, val, memory_order_relaxed, memory_order_relaxed));
+}
+
+/* Totals over the last seconds (at most rates_window) */
+static void amd_rates_sum(const amd_rate_key_t *k, uint32_t seconds, uint64_t out[AMD_STATS_RESULTS])
+{
+    uint32_t now = amd_rates_now(), i, r;
+
+    memset(out, 0, sizeof(uint64_t) * AMD_STATS_RESULTS);
+    if (!seconds || seconds > amd.rates_window) {
+        seconds = amd.rates_window;
+    }
+
+    for (i = 0; i < seconds; i++) {
+        uint32_t sec = (now - i) & 0xfffffff;
+        uint64_t v = atomic_load_explicit(&k->buckets[sec % amd.rates_window], memory_order_relaxed);
+
+        if (AMD_RATE_STAMP(v) == sec) {
+            for (r = 0; r < AMD_STATS_RESULTS; r++) {
+                out[r] += AMD_RATE_COUNT(v, r);
+            }
+        }
+    }
+}
+
+static void amd_rates_print(switch_stream_handle_t *stream, const amd_rate_key_t *k, uint32_t seconds)
+{
+    uint64_t n[AMD_STATS_RESULTS], total;
+
+    amd_rates_sum(k, seconds, n);
+    total = n[0] + n[1] + n[2];
+    stream->write_function(stream, "%s %s window=%u total=%" PRIu64 " machine=%" PRIu64 " human=%" PRIu64 " notsure=%" PRIu64
+                           " machine_rate=%.3f human_rate=%.3f notsure_rate=%.3f",
+                           k->kind == 'c' ? "campaign" : "gateway", k->name,
+                           seconds && seconds < amd.rates_window ? seconds : amd.rates_window, total, n[0], n[1], n[2],
+                           total ? (double)n[0] / total : 0.0, total ? (double)n[1] / total : 0.0, total ? (double)n[2] / total : 0.0);
+    if (k->kind == 'c') {
+        stream->write_function(stream, " active=%u", atomic_load(&k->active));
+    }
+    stream->write_function(stream, "\n");
+}
+
+/*
+ * Per-gateway audio quality, to spot trunks whose silent or noisy audio
+ * drags analysis out. A call counts as NOAUDIO when no analysed frame
+ * reached noaudio_threshold; its noise floor is the mean score of the
+ * frames classified as silence.
+ */
+static void amd_gateway_add(amd_rate_key_t *k, const char *cause, uint32_t decision_ms, uint32_t peak,
+                            uint64_t noise_sum, uint32_t noise_frames, switch_bool_t notsure)
+{
+    uint32_t bucket = decision_ms / 100;
+
+    amd_stats_add(&k->calls, 1);
+    if (peak < amd.noaudio_threshold) {
+        amd_stats_add(&k->noaudio, 1);
+    }
+    if (notsure) {
+        amd_stats_add(&k->notsure, 1);
+    }
+    if (!strcmp(cause, "TOOLONG")) {
+        amd_stats_add(&k->toolong, 1);
+    }
+    if (noise_frames) {
+        amd_stats_add(&k->noise_sum, noise_sum / noise_frames);
+        amd_stats_add(&k->noise_calls, 1);
+    }
+    amd_stats_add(&k->decision_ms[bucket < AMD_STATS_BUCKETS ? bucket : AMD_STATS_BUCKETS - 1], 1);
+}
+
+static void amd_gateway_print(switch_stream_handle_t *stream, amd_rate_key_t *k)
+{
+    uint64_t hist[AMD_STATS_BUCKETS], calls = atomic_load(&k->calls), noise_calls = atomic_load(&k->noise_calls);
+    uint32_t i;
+
+    for (i = 0; i < AMD_STATS_BUCKETS; i++) {
+        hist[i] = atomic_load_explicit(&k->decision_ms[i], memory_order_relaxed);
+    }
+
+    stream->write_function(stream, "gateway %s calls=%" PRIu64 " noaudio_rate=%.3f notsure_rate=%.3f toolong_rate=%.3f"
+                           " noise_floor=%" PRIu64 " p50_ms=%u p90_ms=%u p99_ms=%u\n",
+                           k->name, calls,
+                           calls ? (double)atomic_load(&k->noaudio) / calls : 0.0,
+                           calls ? (double)atomic_load(&k->notsure) / calls : 0.0,
+                           calls ? (double)atomic_load(&k->toolong) / calls : 0.0,
+                           noise_calls ? (uint64_t)atomic_load(&k->noise_sum) / noise_calls : 0,
+                           calls ? amd_stats_percentile(hist, NULL, calls, 50) : 0,
+                           calls ? amd_stats_percentile(hist, NULL, calls, 90) : 0,
+                           calls ? amd_stats_percentile(hist, NULL, calls, 99) : 0);
+}
+
+/* -------------------------
+   Housekeeping thread
+   ------------------------- */
+
+static void *SWITCH_THREAD_FUNC amd_housekeeping_run(switch_thread_t *thread, void *obj)
+{
+    uint32_t ticks = 0;
+
+    (void)thread;
+    (void)obj;
+
+    while (atomic_load(&amd.running)) {
+        switch_yield(1000000);
+        ticks++;
+
+        if (amd.bandit_snapshot_interval && !(ticks % amd.bandit_snapshot_interval)) {
+            amd_bandit_save();
+        }
+
+        if (amd.cache_snapshot_interval && !(ticks % amd.cache_snapshot_interval)) {
+            amd_cache_save();
+        }
+
+        amd_rates_evict();
+    }
+
+    return NULL;
+}
+
+/* -------------------------
+   Pre-roll capture
+   ------------------------- */
+
+/*
+ * amd_preroll keeps the last N ms of inbound audio in a small per-call ring so
+ * that an AMD started late (typically uuid_amd_detect over ESL) can analyse the
+ * audio it missed.  AMD takes the ring over when its bug starts; replay begins at
+ * answer when the capture saw it, so timing is measured from answer.
+ */
+typedef struct {
+    switch_mutex_t *mutex;
+    int16_t *buf;
+    uint32_t size;              /* ring capacity in samples */
+    uint32_t ms;
+    uint32_t rate;
+    uint64_t written;           /* samples captured so far */
+    uint64_t answered_at;       /* value of written at answer, UINT64_MAX before */
+    uint32_t handed_off:1;
+} amd_preroll_t;
+
+static switch_bool_t amd_preroll_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type)
+{
+    amd_preroll_t *pr = (amd_preroll_t *)user_data;
+    switch_core_session_t *session = switch_core_media_bug_get_session(bug);
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+
+    switch (type) {
+    case SWITCH_ABC_TYPE_CLOSE:
+        switch_channel_set_private(channel, AMD_PREROLL_PRIVATE, NULL);
+        break;
+    case SWITCH_ABC_TYPE_READ_PING: {
+        uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
+        switch_frame_t frame = { 0 };
+        const int16_t *pcm;
+        uint32_t n, at, first;
+
+        frame.data = data;
+        frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+
+        if (switch_core_media_bug_read(bug, &frame, SWITCH_FALSE) != SWITCH_STATUS_SUCCESS || !frame.samples) {
+            return pr->handed_off ? SWITCH_FALSE : SWITCH_TRUE;
+        }
+
+        switch_mutex_lock(pr->mutex);
+        if (pr->handed_off) {
+            switch_mutex_unlock(pr->mutex);
+            return SWITCH_FALSE;
+        }
+        if (!pr->buf) {
+            switch_codec_implementation_t impl = { 0 };
+
+            switch_core_session_get_read_impl(session, &impl);
+            pr->rate = impl.actual_samples_per_second ? impl.actual_samples_per_second : 8000;
+            pr->size = pr->rate / 1000 * pr->ms;
+            pr->buf = switch_core_session_alloc(session, pr->size * sizeof(int16_t));
+        }
+        if (pr->answered_at == UINT64_MAX && switch_channel_test_flag(channel, CF_ANSWERED)) {
+            pr->answered_at = pr->written;
+        }
+
+        pcm = (const int16_t *)frame.data;
+        n = frame.samples;
+        if (n > pr->size) {
+            pcm += n - pr->size;
+            pr->written += n - pr->size;
+            n = pr->size;
+        }
+        at = (uint32_t)(pr->written % pr->size);
+        first = pr->size - at < n ? pr->size - at : n;
+        memcpy(pr->buf + at, pcm, first * sizeof(int16_t));
+        memcpy(pr->buf, pcm + first, (n - first) * sizeof(int16_t));
+        pr->written += n;
+        switch_mutex_unlock(pr->mutex);
+        break;
+    }
+    default:
+        break;
+    }
+
+    return SWITCH_TRUE;
+}
+
+/* Hand the captured audio to AMD and stop capturing; NULL if there is nothing usable */
+static int16_t *amd_preroll_take(switch_core_session_t *session, uint32_t rate, uint32_t *samples)
+{
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    amd_preroll_t *pr = switch_channel_get_private(channel, AMD_PREROLL_PRIVATE);
+    int16_t *out = NULL;
+    uint64_t start, i;
+
+    *samples = 0;
+    if (!pr) {
+        return NULL;
+    }
+
+    switch_mutex_lock(pr->mutex);
+    if (!pr->handed_off && pr->buf && pr->rate == rate && pr->written) {
+        start = pr->written > pr->size ? pr->written - pr->size : 0;
+        if (pr->answered_at != UINT64_MAX && pr->answered_at > start) {
+            start = pr->answered_at;
+        }
+        if ((*samples = (uint32_t)(pr->written - start))) {
+            out = switch_core_session_alloc(session, *samples * sizeof(int16_t));
+            for (i = start; i < pr->written; i++) {
+                out[i - start] = pr->buf[i % pr->size];
+            }
+        }
+    }
+    pr->handed_off = 1;
+    switch_mutex_unlock(pr->mutex);
+
+    return out;
+}
+
+SWITCH_STANDARD_APP(amd_preroll_function)
+{
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_media_bug_t *bug = NULL;
+    amd_preroll_t *pr;
+    const char *val = !zstr(data) ? data : switch_channel_get_variable(channel, "amd_preroll_ms");
+    int ms = val ? atoi(val) : 0;
+
+    if (ms <= 0) {
+        ms = 1000;
+    } else if (ms > AMD_PREROLL_MAX_MS) {
+        ms = AMD_PREROLL_MAX_MS;
+    }
+
+    if (switch_channel_get_private(channel, AMD_PREROLL_PRIVATE)) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "AMD: Pre-roll already running\n");
+        return;
+    }
+
+    pr = switch_core_session_alloc(session, sizeof(*pr));
+    pr->ms = (uint32_t)ms;
+    pr->answered_at = UINT64_MAX;
+    switch_mutex_init(&pr->mutex, SWITCH_MUTEX_NESTED, switch_core_session_get_pool(session));
+
+    if (switch_core_media_bug_add(session, BUG_AMD_NAME_PREROLL, NULL, amd_preroll_callback, pr, 0,
+                                  SMBF_READ_STREAM | SMBF_READ_PING | SMBF_NO_PAUSE, &bug) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Failed to add media bug for AMD pre-roll.\n");
+        return;
+    }
+    switch_channel_set_private(channel, AMD_PREROLL_PRIVATE, pr);
+
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "AMD: Pre-roll capturing last %dms\n", ms);
+}
+
+/* -------------------------
+   Echo canceller
+   ------------------------- */
+
+/*
+ * NLMS canceller for our own prompt leaking back into the read stream. The
+ * reference is the write stream; weights and history are fixed-size float
+ * arrays from the session pool. Adaptation freezes while the callee talks
+ * (Geigel detector) and the filter is skipped once the prompt has been silent
+ * for a whole tail.
+ */
+typedef struct {
+    uint32_t taps;              /* multiple of 8 */
+    float mu;
+    float *w;                   /* w[taps - 1] is the zero-delay tap */
+    float *x;                   /* taps - 1 past reference samples, then the current frame */
+    float ref_peak;
+    uint32_t hold;              /* frames left with adaptation frozen */
+    uint32_t idle;              /* samples since the reference was last non-zero */
+} amd_aec_t;
+
+static amd_aec_t *amd_aec_create(switch_core_session_t *session, uint32_t taps)
+{
+    amd_aec_t *aec = switch_core_session_alloc(session, sizeof(*aec));
+
+    taps = (taps + 7) & ~7u;
+    aec->taps = taps > AMD_AEC_MAX_TAPS ? AMD_AEC_MAX_TAPS : taps;
+    aec->mu = 0.3f;
+    aec->w = switch_core_session_alloc(session, aec->taps * sizeof(float));
+    aec->x = switch_core_session_alloc(session, (aec->taps + AMD_AEC_MAX_FRAME) * sizeof(float));
+    aec->idle = aec->taps;
+    return aec;
+}
+
+/* Eight independent accumulators so the compiler can vectorise without -ffast-math */
+static float amd_aec_dot(const float *restrict a, const float *restrict b, uint32_t n)
+{
+    float acc[8] = { 0 };
+    uint32_t i, j;
+
+    for (i = 0; i < n / 8; i++) {
+        const float *x = a + 8 * i, *y = b + 8 * i;
+
+        for (j = 0; j < 8; j++) {
+            acc[j] += x[j] * y[j];
+        }
+    }
+
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+static void amd_aec_update(float *restrict w, const float *restrict x, float g, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        w[i] += g * x[i];
+    }
+}
+
+/*
+ * Filtering skipped (overload tier, CPU budget): still shift ref into the
+ * history so the taps line up with the echo path when filtering resumes.
+ */
+static void amd_aec_skip(amd_aec_t *aec, const int16_t *ref, uint32_t n)
+{
+    uint32_t taps = aec->taps, i;
+    float *x = aec->x, rpeak = 0.0f;
+
+    if (n > AMD_AEC_MAX_FRAME) {
+        n = AMD_AEC_MAX_FRAME;
+    }
+
+    for (i = 0; i < n; i++) {
+        float r = (float)ref[i];
+
+        x[taps - 1 + i] = r;
+        rpeak = fabsf(r) > rpeak ? fabsf(r) : rpeak;
+    }
+    aec->idle = rpeak > 0.0f ? 0 : aec->idle + n;
+    aec->ref_peak = rpeak > aec->ref_peak * 0.9f ? rpeak : aec->ref_peak * 0.9f;
+
+    memmove(x, x + n, (taps - 1) * sizeof(float));
+}
+
+/* Replace d with d minus the estimated echo of ref, in place */
+static void amd_aec_process(amd_aec_t *aec, int16_t *d, const int16_t *ref, uint32_t n)
+{
+    uint32_t taps = aec->taps, i;
+    float *x = aec->x, dpeak = 0.0f, rpeak = 0.0f, power;
+    switch_bool_t adapt;
+
+    if (n > AMD_AEC_MAX_FRAME) {
+        n = AMD_AEC_MAX_FRAME;
+    }
+
+    for (i = 0; i < n; i++) {
+        float r = (float)ref[i], a = fabsf((float)d[i]);
+
+        x[taps - 1 + i] = r;
+        rpeak = fabsf(r) > rpeak ? fabsf(r) : rpeak;
+        dpeak = a > dpeak ? a : dpeak;
+    }
+    aec->idle = rpeak > 0.0f ? 0 : aec->idle + n;
+    aec->ref_peak = rpeak > aec->ref_peak * 0.9f ? rpeak : aec->ref_peak * 0.9f;
+
+    if (aec->idle < taps) {
+        if (dpeak > 0.5f * aec->ref_peak) {
+            aec->hold = 10;
+        }
+        adapt = !aec->hold;
+        if (aec->hold) {
+            aec->hold--;
+        }
+
+        power = amd_aec_dot(x, x, taps);
+        for (i = 0; i < n; i++) {
+            const float *win = x + i;
+            float e = (float)d[i] - amd_aec_dot(aec->w, win, taps);
+
+            if (adapt) {
+                amd_aec_update(aec->w, win, aec->mu * e / (power + 1.0e4f), taps);
+            }
+            d[i] = (int16_t)(e > 32767.0f ? 32767.0f : e < -32768.0f ? -32768.0f : e);
+            if (i + 1 < n) {
+                power += win[taps] * win[taps] - win[0] * win[0];
+            }
+        }
+    }
+
+    memmove(x, x + n, (taps - 1) * sizeof(float));
+}
+
+/* -------------------------
+   VAD state and classifier
+   ------------------------- */
+
+typedef enum {
+    SILENCE,
+    VOICED
+} amd_frame_classifier;
+
+typedef enum {
+    VAD_STATE_IN_WORD,
+    VAD_STATE_IN_SILENCE,
+} amd_vad_state_t;
+
+/* One detected word: sample offsets from the start of analysis and mean amplitude score */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t energy;
+} amd_word_t;
+
+typedef struct amd_vad_c {
+    switch_core_session_t *session;
+    switch_channel_t *channel;
+    switch_codec_implementation_t read_impl;
+
+    amd_vad_state_t state;
+    amd_params_t params;
+    uint32_t frame_ms;
+    int32_t sample_count_limit;
+
+    uint32_t silence_duration;
+    uint32_t voice_duration;
+    uint32_t words;
+
+    const char *profile;        /* profile name the parameters came from, if any */
+    const char *destination;    /* number used for prefix and history lookups */
+    uint64_t samples;           /* samples analysed so far */
+    uint32_t decision_ms;
+    const char *source;         /* "builtin" or "remote" */
+
+    uint32_t ext_call_id;       /* external classifier stream, 0 if none */
+    amd_shm_session_t *shm_session;     /* shared-memory analyser session, if any */
+    uint32_t shm_generation;
+    const char *held_result;    /* built-in verdict waiting for the classifier deadline */
+    const char *held_cause;
+
+    int16_t *preroll;           /* audio captured before AMD started, replayed on the first frame */
+    uint32_t preroll_samples;
+
+    amd_params_t answer_params; /* parameters to switch to at answer when started in early media */
+    const char *answer_profile;
+    float tone_coef[AMD_TONE_BINS];     /* Goertzel coefficients for tone_rate */
+    uint32_t tone_rate;
+    uint32_t tone_run;          /* consecutive steady tonal frames */
+    uint32_t tone_level;        /* smoothed score of the current tone */
+
+    const int16_t *ref;         /* write-stream (prompt) samples of the current frame, if captured */
+    float echo_gain;            /* estimated prompt-to-read echo amplitude ratio */
+    uint32_t talkover_ms;       /* consecutive callee speech while the prompt plays */
+    amd_aec_t *aec;             /* prompt echo canceller, if aec_taps is set */
+
+    teletone_dtmf_detect_state_t *dtmf_detect;  /* inband detector, if dtmf is set */
+    atomic_int dtmf_digit;      /* digit from the recv_dtmf hook (RFC2833 / SIP INFO), 0 if none */
+
+    uint32_t confidence;        /* 0-100, how strongly the state supports the verdict */
+    uint32_t progress_ms;       /* elapsed time of the last amd::progress event */
+
+    const char *stage;          /* "fast" while announcing the provisional verdict, else final */
+    const char *fast_result;    /* provisional verdict, once announced */
+    const char *fast_cause;
+    uint32_t fast_ms;
+
+    uint32_t frame_score;       /* amplitude score of the frame being handled */
+    amd_word_t timeline[AMD_MAX_TIMELINE];
+    uint32_t timeline_count;
+    uint64_t run_start;         /* first sample of the current voiced run */
+    uint64_t run_energy;
+    uint32_t run_frames;
+
+    amd_capture_t *capture;     /* last capture_seconds of analysed audio, if this call is sampled */
+    const char *capture_results;        /* capture_results as of start, NULL when the call is not sampled */
+    uint32_t capture_size;
+    uint64_t capture_pos;       /* samples written to the ring */
+
+    uint32_t round;             /* detection round, from 1 */
+    uint32_t monitor_frames;    /* frames seen while monitoring, for decimation */
+    uint32_t monitor_events;
+
+    const char *campaign;               /* campaign_variable's value at start, if any */
+    amd_rate_key_t *campaign_rates;     /* window counters this call feeds, if any */
+    amd_rate_key_t *gateway_rates;
+    uint32_t peak_score;        /* loudest analysed frame, for NOAUDIO */
+    uint32_t noise_frames;      /* frames classified as silence, and their summed scores */
+    uint64_t noise_sum;
+
+    uint32_t degrade;           /* overload tier this call runs at regardless of load (lite admission) */
+    uint32_t budget_degrade;    /* overload tier this round runs at after half its cpu_budget_us */
+    uint32_t stride;            /* frames the analysed frame stands for under overload, 0 = 1 */
+    uint32_t skipped;
+
+    uint64_t cpu_ns;            /* time spent in the read callback, all rounds */
+    uint64_t budget_base;       /* cpu_ns when the round started, for cpu_budget_us */
+    uint32_t frames;            /* frames handled by the read callback */
+
+    uint32_t in_initial_silence:1;
+    uint32_t in_greeting:1;
+    uint32_t early:1;           /* still analysing early media */
+    uint32_t stereo:1;          /* bug reads read+write interleaved */
+    uint32_t finished:1;        /* verdict published and execute-on hook run */
+    uint32_t monitoring:1;      /* verdict given; watching for a later greeting */
+    uint32_t run_logged:1;      /* current voiced run has a timeline entry */
+    uint32_t refused:1;         /* verdict given without analysis (overload, capacity) */
+    uint32_t admitted:1;        /* holds a max_sessions / campaign slot */
+    uint32_t lite:1;            /* holds a lite_max_sessions slot instead */
+} amd_vad_t;
+
+/* Overload tier that applies to this call: the node's, the call's own or the round's, whichever is highest */
+static uint32_t amd_vad_tier(const amd_vad_t *vad)
+{
+    uint32_t tier = amd_overload_tier();
+
+    if (vad->degrade > tier) {
+        tier = vad->degrade;
+    }
+
+    return vad->budget_degrade > tier ? vad->budget_degrade : tier;
+}
+
+/* "start-end:energy,..." in samples, or the same as a JSON array of triples */
+static void amd_timeline_format(const amd_vad_t *vad, char *buf, size_t len, switch_bool_t json)
+{
+    size_t used = 0;
+    uint32_t i;
+
+    buf[0] = '\0';
+    if (json) {
+        used += switch_snprintf(buf, len, "[");
+    }
+    for (i = 0; i < vad->timeline_count && used < len; i++) {
+        const amd_word_t *w = &vad->timeline[i];
+
+        used += switch_snprintf(buf + used, len - used, json ? "%s[%" PRIu64 ",%" PRIu64 ",%u]" : "%s%" PRIu64 "-%" PRIu64 ":%u",
+                                i ? "," : "", w->start, w->end, w->energy);
+    }
+    if (json && used < len) {
+        switch_snprintf(buf + used, len - used, "]");
+    }
+}
+
+/* Fire a custom event and queue a clone to the session */
+static void amd_fire_event(const char *result, const char *cause, const amd_vad_t *vad)
+{
+    switch_core_session_t *fs_s = vad->session;
+    switch_event_t *event = NULL;
+    switch_event_t *event_copy = NULL;
+
+    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "amd") != SWITCH_STATUS_SUCCESS) {
+        return;
+    }
+
+    /* AMD result/cause */
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Result", result);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Cause", cause);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Decision-Ms", "%u", vad->decision_ms);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Source", vad->source ? vad->source : "builtin");
+    if (vad->profile) {
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Profile", vad->profile);
+    }
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Early-Media", vad->early ? "true" : "false");
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Confidence", "%u", vad->confidence);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Stage", vad->stage ? vad->stage : "final");
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Round", "%u", vad->round);
+    if (vad->timeline_count) {
+        char timeline[AMD_MAX_TIMELINE * 64];
+
+        amd_timeline_format(vad, timeline, sizeof(timeline), SWITCH_FALSE);
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Timeline", timeline);
+        switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Sample-Rate", "%u", vad->read_impl.actual_samples_per_second);
+    }
+
+    /* Include channel identifiers */
+    if (fs_s) {
+        const char *uuid = switch_core_session_get_uuid(fs_s);
+        if (uuid) {
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", uuid);
+            /* If you also want an alias, uncomment:
+               switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-Unique-ID", uuid);
+            */
+        }
+        /* Optional, handy for debugging */
+        {
+            switch_channel_t *ch = switch_core_session_get_channel(fs_s);
+            if (ch) {
+                const char *ch_name = switch_channel_get_name(ch);
+                if (ch_name) {
+                    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Channel-Name", ch_name);
+                }
+            }
+        }
+    }
+
+    if (switch_event_dup(&event_copy, event) != SWITCH_STATUS_SUCCESS) {
+        switch_event_destroy(&event);
+        return;
+    }
+
+    /* Queue to the session and fire globally */
+    switch_core_session_queue_event(fs_s, &event);
+    switch_event_fire(&event_copy);
+}
+
+static uint32_t amd_elapsed_ms(const amd_vad_t *vad)
+{
+    return vad->read_impl.actual_samples_per_second ? (uint32_t)(vad->samples * 1000 / vad->read_impl.actual_samples_per_second) : 0;
+}
+
+static float amd_fraction(uint32_t value, uint32_t limit)
+{
+    return !limit ? 0.0f : value >= limit ? 1.0f : (float)value / (float)limit;
+}
+
+/*
+ * Machine likelihood (0-100) from how far the state machine has come towards
+ * each kind of rule: words and voice towards the MACHINE limits, silence
+ * towards the HUMAN ones. 50 means no evidence either way.
+ */
+static uint32_t amd_machine_score(const amd_vad_t *vad)
+{
+    const amd_params_t *p = &vad->params;
+    float machine, human = 0.0f, m;
+
+    machine = amd_fraction(vad->words, p->maximum_number_of_words);
+    m = amd_fraction(vad->voice_duration, p->maximum_word_length);
+    machine = m > machine ? m : machine;
+    if (vad->in_greeting) {
+        m = amd_fraction(vad->voice_duration, p->greeting);
+        machine = m > machine ? m : machine;
+    }
+
+    if (vad->in_initial_silence) {
+        human = amd_fraction(vad->silence_duration, p->initial_silence);
+    } else if (vad->in_greeting && vad->state == VAD_STATE_IN_SILENCE) {
+        human = amd_fraction(vad->silence_duration, p->after_greeting_silence);
+    }
+
+    return (uint32_t)(50.0f + 50.0f * (machine - human) + 0.5f);
+}
+
+static uint32_t amd_confidence(const amd_vad_t *vad, const char *result, const char *cause)
+{
+    uint32_t score = amd_machine_score(vad);
+
+    if (!strcmp(cause, "DTMF") || !strcmp(cause, "TALKOVER")) {
+        return 100;
+    }
+    if (!strcmp(result, "MACHINE")) {
+        return score;
+    }
+    if (!strcmp(result, "HUMAN")) {
+        return 100 - score;
+    }
+    return 100 - 2 * (score > 50 ? score - 50 : 50 - score);  /* NOTSURE: sure it is ambiguous */
+}
+
+static const char *amd_phase(const amd_vad_t *vad)
+{
+    if (vad->in_initial_silence) {
+        return "initial_silence";
+    }
+    if (vad->in_greeting) {
+        return vad->state == VAD_STATE_IN_SILENCE ? "after_greeting" : "greeting";
+    }
+    return "word";
+}
+
+/* Interim amd::progress event, at most one per progress_interval */
+static void amd_progress(amd_vad_t *vad)
+{
+    switch_event_t *event = NULL;
+    uint32_t elapsed = amd_elapsed_ms(vad), score;
+
+    if (!vad->params.progress_interval || elapsed - vad->progress_ms < vad->params.progress_interval || amd_vad_tier(vad) >= 1) {
+        return;
+    }
+    vad->progress_ms = elapsed;
+
+    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, AMD_EVENT_PROGRESS) != SWITCH_STATUS_SUCCESS) {
+        return;
+    }
+    score = amd_machine_score(vad);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", switch_core_session_get_uuid(vad->session));
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Machine-Score", "%u", score);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Leaning", score > 50 ? "MACHINE" : score < 50 ? "HUMAN" : "NOTSURE");
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Elapsed-Ms", "%u", elapsed);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Words", "%u", vad->words);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Phase", amd_phase(vad));
+    if (vad->profile) {
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Profile", vad->profile);
+    }
+    switch_event_fire(&event);
+}
+
+/*
+ * Two-stage mode: once fast_verdict ms have been analysed, announce the
+ * current leaning as a provisional verdict (amd event with AMD-Stage: fast)
+ * and keep listening. amd_result is only set by the final verdict.
+ */
+static void amd_fast_verdict(amd_vad_t *vad)
+{
+    uint32_t score = amd_machine_score(vad);
+
+    /* 50 is no evidence either way; a dialer hangs up on MACHINE, so that is NOTSURE */
+    vad->fast_result = score > 50 ? "MACHINE" : score < 50 ? "HUMAN" : "NOTSURE";
+    vad->fast_cause = "FAST";
+    vad->fast_ms = amd_elapsed_ms(vad);
+    vad->decision_ms = vad->fast_ms;
+    vad->confidence = amd_confidence(vad, vad->fast_result, vad->fast_cause);
+
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                      "AMD: Fast verdict %s after %ums (score %u)\n", vad->fast_result, vad->fast_ms, score);
+
+    switch_channel_set_variable(vad->channel, "amd_fast_result", vad->fast_result);
+    switch_channel_set_variable_printf(vad->channel, "amd_fast_decision_ms", "%u", vad->fast_ms);
+    vad->stage = "fast";
+    amd_fire_event(vad->fast_result, vad->fast_cause, vad);
+    vad->stage = NULL;
+}
+
+static void amd_fire_correction(const amd_vad_t *vad, const char *result, const char *cause)
+{
+    switch_event_t *event = NULL;
+
+    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, AMD_EVENT_CORRECTION) != SWITCH_STATUS_SUCCESS) {
+        return;
+    }
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", switch_core_session_get_uuid(vad->session));
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Fast-Result", vad->fast_result);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Fast-Decision-Ms", "%u", vad->fast_ms);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Result", result);
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Cause", cause);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Decision-Ms", "%u", vad->decision_ms);
+    switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Confidence", "%u", vad->confidence);
+    switch_event_fire(&event);
+}
+
+static void amd_result_json(const amd_vad_t *vad, const char *result, const char *cause, char *json, size_t len)
+{
+    char words[AMD_MAX_TIMELINE * 64], eresult[64], ecause[160], eprofile[AMD_PROFILE_NAME_LEN * 6 + 1], esource[64];
+
+    amd_timeline_format(vad, words, sizeof(words), SWITCH_TRUE);
+    amd_json_escape(eresult, sizeof(eresult), result);
+    amd_json_escape(ecause, sizeof(ecause), cause);
+    amd_json_escape(eprofile, sizeof(eprofile), vad->profile);
+    amd_json_escape(esource, sizeof(esource), vad->source ? vad->source : "builtin");
+    switch_snprintf(json, len,
+                    "{\"result\":\"%s\",\"cause\":\"%s\",\"decision_ms\":%u,\"confidence\":%u,\"round\":%u,"
+                    "\"profile\":\"%s\",\"source\":\"%s\",\"rate\":%u,\"words\":%s}",
+                    eresult, ecause, vad->decision_ms, vad->confidence, vad->round,
+                    eprofile, esource, vad->read_impl.actual_samples_per_second, words);
+}
+
+/* Queue the verdict for the decision log; json is the amd_result_json object */
+static void amd_log_decision(const amd_vad_t *vad, const char *json)
+{
+    char destination[128];
+    amd_log_record_t *rec;
+    int n;
+
+    if (!amd.log_thread) {
+        return;
+    }
+    if (!(rec = amd_ring_claim(&amd.log_ring))) {
+        atomic_fetch_add(&amd.log_dropped, 1);
+        return;
+    }
+
+    amd_json_escape(destination, sizeof(destination), vad->destination);
+    n = switch_snprintf(rec->line, sizeof(rec->line),
+                        "{\"ts\":%" SWITCH_TIME_T_FMT ",\"uuid\":\"%s\",\"destination\":\"%s\",\"early\":%s,"
+                        "\"fast_ms\":%u,\"frames\":%u,\"cpu_ns\":%llu,%s",
+                        switch_micro_time_now(), switch_core_session_get_uuid(vad->session), destination,
+                        vad->early ? "true" : "false", vad->fast_result ? vad->fast_ms : 0, vad->frames,
+                        (unsigned long long)vad->cpu_ns, json + 1);
+    if (n < 0 || (size_t)n >= sizeof(rec->line) - 1) {
+        n = (int)sizeof(rec->line) - 2;
+    }
+    rec->line[n] = '\n';
+    rec->len = (uint32_t)n + 1;
+    amd_ring_publish(rec);
+}
+
+static void amd_capture_frame(amd_vad_t *vad, const int16_t *pcm, uint32_t n)
+{
+    uint32_t at, first;
+
+    if (n > vad->capture_size) {
+        pcm += n - vad->capture_size;
+        vad->capture_pos += n - vad->capture_size;
+        n = vad->capture_size;
+    }
+    at = (uint32_t)(vad->capture_pos % vad->capture_size);
+    first = vad->capture_size - at < n ? vad->capture_size - at : n;
+    memcpy(vad->capture->pcm + at, pcm, first * sizeof(int16_t));
+    memcpy(vad->capture->pcm, pcm + first, (n - first) * sizeof(int16_t));
+    vad->capture_pos += n;
+}
+
+/* Give a sampled call (or its next round, once the last ring went to the writer) an empty ring */
+static void amd_capture_alloc(amd_vad_t *vad)
+{
+    if (!vad->capture_size || !(vad->capture = malloc(sizeof(*vad->capture) + vad->capture_size * sizeof(int16_t)))) {
+        return;
+    }
+    vad->capture->size = vad->capture_size;
+    vad->capture_pos = 0;
+}
+
+/*
+ * Hand the ring itself to the writer if the verdict is selected: no copy and
+ * no allocation here. The ring is left untouched otherwise.
+ */
+static void amd_capture_submit(amd_vad_t *vad, const char *result, const char *cause)
+{
+    amd_capture_t *job = vad->capture, **slot;
+
+    if (!job || !vad->capture_pos || !amd_list_has(vad->capture_results, result)) {
+        return;
+    }
+
+    if (!(slot = amd_ring_claim(&amd.capture_ring))) {
+        atomic_fetch_add(&amd.capture_dropped, 1);
+        return;
+    }
+
+    switch_copy_string(job->uuid, switch_core_session_get_uuid(vad->session), sizeof(job->uuid));
+    switch_copy_string(job->result, result, sizeof(job->result));
+    switch_copy_string(job->cause, cause, sizeof(job->cause));
+    job->round = vad->round;
+    job->rate = vad->read_impl.actual_samples_per_second;
+    job->samples = vad->capture_pos > vad->capture_size ? vad->capture_size : (uint32_t)vad->capture_pos;
+    job->first = vad->capture_pos > vad->capture_size ? (uint32_t)(vad->capture_pos % vad->capture_size) : 0;
+
+    vad->capture = NULL;
+    *slot = job;
+    amd_ring_publish(slot);
+}
+
+/* Record a verdict on the channel and announce it */
+static void amd_decide(amd_vad_t *vad, const char *result, const char *cause)
+{
+    char json[AMD_MAX_TIMELINE * 64 + 512];
+
+    if (vad->read_impl.actual_samples_per_second) {
+        vad->decision_ms = (uint32_t)(vad->samples * 1000 / vad->read_impl.actual_samples_per_second);
+    }
+    vad->confidence = amd_confidence(vad, result, cause);
+
+    switch_channel_set_variable(vad->channel, "amd_result", result);
+    switch_channel_set_variable(vad->channel, "amd_cause", cause);
+    switch_channel_set_variable_printf(vad->channel, "amd_decision_ms", "%u", vad->decision_ms);
+    switch_channel_set_variable(vad->channel, "amd_early_media", vad->early ? "true" : "false");
+    switch_channel_set_variable_printf(vad->channel, "amd_confidence", "%u", vad->confidence);
+    switch_channel_set_variable_printf(vad->channel, "amd_round", "%u", vad->round);
+    amd_result_json(vad, result, cause, json, sizeof(json));
+    switch_channel_set_variable(vad->channel, "amd_result_json", json);
+    amd_log_decision(vad, json);
+    amd_stats_decision(result, cause, vad->decision_ms);
+    if (vad->round == 1 && !vad->refused) {
+        if (vad->campaign_rates) {
+            amd_rates_add(vad->campaign_rates, amd_stats_result(result));
+        }
+        if (vad->gateway_rates) {
+            amd_rates_add(vad->gateway_rates, amd_stats_result(result));
+            amd_gateway_add(vad->gateway_rates, cause, vad->decision_ms, vad->peak_score,
+                            vad->noise_sum, vad->noise_frames, !strcmp(result, "NOTSURE"));
+        }
+    }
+    amd_fire_event(result, cause, vad);
+    amd_capture_submit(vad, result, cause);
+
+    if (vad->fast_result) {
+        switch_bool_t corrected = strcmp(vad->fast_result, result) != 0;
+
+        switch_channel_set_variable(vad->channel, "amd_corrected", corrected ? "true" : "false");
+        if (corrected) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                              "AMD: Correction %s -> %s/%s\n", vad->fast_result, result, cause);
+            amd_fire_correction(vad, result, cause);
+        }
+    }
+
+    if (!vad->refused) {
+        amd_cache_store(vad->destination, result, cause);
+    }
+}
+
+/* Start the word/silence state machine over, keeping the call's parameters */
+static void amd_vad_reset(amd_vad_t *vad)
+{
+    vad->state = VAD_STATE_IN_WORD;
+    vad->silence_duration = 0;
+    vad->voice_duration = 0;
+    vad->words = 0;
+    vad->in_initial_silence = 1;
+    vad->in_greeting = 0;
+    vad->samples = 0;
+    vad->held_result = NULL;
+    vad->held_cause = NULL;
+    vad->fast_result = NULL;
+    vad->fast_cause = NULL;
+    vad->progress_ms = 0;
+    vad->talkover_ms = 0;
+    atomic_store(&vad->dtmf_digit, 0);
+    vad->timeline_count = 0;
+    vad->run_logged = 0;
+    vad->budget_base = vad->cpu_ns;
+    vad->budget_degrade = 0;
+    vad->sample_count_limit = vad->params.total_analysis_time ?
+        (int32_t)(vad->read_impl.actual_samples_per_second / 1000 * vad->params.total_analysis_time) : 0;
+}
+
+static switch_bool_t amd_ext_active(const amd_vad_t *vad)
+{
+    return vad->ext_call_id || vad->shm_session;
+}
+
+/* Detach from the external classifier and the shared-memory analyser */
+static void amd_ext_stop(amd_vad_t *vad)
+{
+    if (vad->ext_call_id) {
+        amd_ext_send(vad->ext_call_id, AMD_EXT_STOP, NULL, 0, 0, NULL);
+        amd_ext_close(vad->ext_call_id);
+        vad->ext_call_id = 0;
+    }
+    if (vad->shm_session) {
+        amd_shm_close(vad->shm_session, vad->shm_generation);
+        vad->shm_session = NULL;
+    }
+}
+
+/* Built-in state machine reached a verdict. While an external analyser may
+ * still answer within its deadline the verdict is held. Returns SWITCH_TRUE when analysis is over. */
+static void amd_monitor_verdict(amd_vad_t *vad, const char *result, const char *cause);
+
+static switch_bool_t amd_conclude(amd_vad_t *vad, const char *result, const char *cause)
+{
+    if (vad->monitoring) {
+        amd_monitor_verdict(vad, result, cause);
+        return SWITCH_FALSE;
+    }
+
+    /* Before answer, silence or a timeout says nothing about who will pick up; only MACHINE counts */
+    if (vad->early && strcmp(result, "MACHINE")) {
+        uint64_t samples = vad->samples, budget_base = vad->budget_base;
+        uint32_t budget_degrade = vad->budget_degrade;
+
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: Ignoring %s/%s before answer; starting over\n", result, cause);
+        amd_vad_reset(vad);
+        vad->samples = samples;
+        vad->budget_base = budget_base;
+        vad->budget_degrade = budget_degrade;
+        return SWITCH_FALSE;
+    }
+
+    if (amd_ext_active(vad) && amd_elapsed_ms(vad) < vad->params.classifier_deadline) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: Holding %s/%s until classifier deadline (%ums)\n", result, cause, vad->params.classifier_deadline);
+        vad->held_result = result;
+        vad->held_cause = cause;
+        return SWITCH_FALSE;
+    }
+
+    amd_ext_stop(vad);
+    amd_decide(vad, result, cause);
+    return SWITCH_TRUE;
+}
+
+/* Copy a posted remote verdict, if any, from the socket mailbox or the shared-memory session */
+static switch_bool_t amd_ext_verdict(const amd_vad_t *vad, char result[8], char cause[24])
+{
+    if (vad->ext_call_id) {
+        amd_ext_slot_t *slot = &amd.classifier_slots[vad->ext_call_id % AMD_EXT_SLOTS];
+
+        if (atomic_load_explicit(&slot->verdict, memory_order_acquire) == vad->ext_call_id) {
+            memcpy(result, slot->result, 8);
+            memcpy(cause, slot->cause, 24);
+            return SWITCH_TRUE;
+        }
+    }
+
+    if (vad->shm_session &&
+        atomic_load_explicit(&vad->shm_session->verdict, memory_order_acquire) == vad->shm_generation) {
+        memcpy(result, vad->shm_session->result, 8);
+        memcpy(cause, vad->shm_session->cause, 24);
+        result[7] = cause[23] = '\0';
+        if (strcmp(result, "HUMAN") && strcmp(result, "MACHINE") && strcmp(result, "NOTSURE")) {
+            return SWITCH_FALSE;
+        }
+        if (!*cause || !amd_cause_valid(cause)) {
+            switch_copy_string(cause, "REMOTE", 24);
+        }
+        return SWITCH_TRUE;
+    }
+
+    return SWITCH_FALSE;
+}
+
+/* Feed a frame to external analysers and settle remote / held verdicts.
+ * Returns SWITCH_TRUE when the call has been decided here. */
+static switch_bool_t amd_ext_process(amd_vad_t *vad, const switch_frame_t *f)
+{
+    uint32_t elapsed = amd_elapsed_ms(vad);
+    char result[8], cause[24];
+
+    if (amd_ext_verdict(vad, result, cause)) {
+        amd_ext_stop(vad);
+
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: Classifier verdict %s/%s after %ums\n", result, cause, elapsed);
+        vad->source = "remote";
+        amd_decide(vad, switch_core_session_strdup(vad->session, result), switch_core_session_strdup(vad->session, cause));
+        return SWITCH_TRUE;
+    }
+
+    if (elapsed >= vad->params.classifier_deadline) {
+        amd_ext_stop(vad);
+        if (vad->held_result) {
+            amd_decide(vad, vad->held_result, vad->held_cause);
+            return SWITCH_TRUE;
+        }
+        return SWITCH_FALSE;
+    }
+
+    if (vad->ext_call_id) {
+        amd_ext_send(vad->ext_call_id, AMD_EXT_AUDIO, f->data, f->samples, 0, NULL);
+    }
+    if (vad->shm_session) {
+        amd_shm_push(vad->shm_session, f->data, f->samples);
+    }
+    return SWITCH_FALSE;
+}
+
+
+/* Mean absolute amplitude */
+static uint32_t amd_frame_score(const int16_t *audio, uint32_t samples)
+{
+    uint32_t count;
+    double energy = 0.0;
+
+    if (!samples) {
+        return 0;
+    }
+
+    for (count = 0; count < samples; count++) {
+        energy += abs(audio[count]);
+    }
+
+    return (uint32_t)(energy / samples);
+}
+
+static amd_frame_classifier classify_frame(uint32_t silence_threshold, const switch_frame_t *f, uint32_t *score)
+{
+    *score = amd_frame_score((const int16_t *)f->data, f->samples);
+
+    return (*score >= silence_threshold) ? VOICED : SILENCE;
+}
+
+/*
+ * Classify a frame while our prompt may be playing. The echo ratio follows the
+ * smallest read/write ratio seen during the prompt (drops at once, rises slowly),
+ * and only read energy above that echo estimate counts as callee speech.
+ */
+static amd_frame_classifier amd_classify_with_prompt(amd_vad_t *vad, const switch_frame_t *f, switch_bool_t *prompt)
+{
+    uint32_t rscore = amd_frame_score((const int16_t *)f->data, f->samples);
+    uint32_t wscore = amd_frame_score(vad->ref, f->samples);
+    float residual;
+
+    *prompt = wscore >= vad->params.silence_threshold;
+    vad->frame_score = rscore;
+    if (!*prompt) {
+        return rscore >= vad->params.silence_threshold ? VOICED : SILENCE;
+    }
+
+    {
+        float ratio = (float)rscore / (float)wscore;
+
+        vad->echo_gain = ratio < vad->echo_gain ? ratio : vad->echo_gain * 0.98f + ratio * 0.02f;
+    }
+
+    residual = (float)rscore - vad->echo_gain * (float)wscore;
+    vad->frame_score = residual > 0.0f ? (uint32_t)residual : 0;
+    return residual >= (float)vad->params.silence_threshold ? VOICED : SILENCE;
+}
+
+/* Call-progress tone frequencies: ringback, busy and dial tones, then the SIT tones */
+static const float amd_tone_hz[AMD_TONE_BINS] = {
+    300, 325, 350, 375, 400, 425, 450, 475, 500, 525, 550, 575, 600, 625, 650,
+    914, 985, 1371, 1429, 1777
+};
+
+/*
+ * Before answer, ringback and other call-progress tones are neither speech
+ * nor silence. A frame is tonal when one Goertzel bin holds at least 40% of
+ * its energy (a dual tone splits about evenly) and its level stays within a
+ * third of the tone's; AMD_TONE_FRAMES such frames in a row make a tone.
+ * Speech spreads over many harmonics and its level moves, so it rarely
+ * qualifies for that long.
+ */
+static switch_bool_t amd_tone_frame(amd_vad_t *vad, const switch_frame_t *f)
+{
+    const int16_t *pcm = (const int16_t *)f->data;
+    uint32_t i, b, score, rate = vad->read_impl.actual_samples_per_second;
+    float energy = 0.0f, peak = 0.0f;
+    switch_bool_t tonal;
+
+    score = amd_frame_score(pcm, f->samples);
+    if (score < vad->params.silence_threshold) {
+        vad->tone_run = 0;
+        return SWITCH_FALSE;
+    }
+
+    if (vad->tone_rate != rate) {
+        for (b = 0; b < AMD_TONE_BINS; b++) {
+            vad->tone_coef[b] = 2.0f * cosf(6.2831853f * amd_tone_hz[b] / (float)rate);
+        }
+        vad->tone_rate = rate;
+    }
+
+    for (i = 0; i < f->samples; i++) {
+        energy += (float)pcm[i] * (float)pcm[i];
+    }
+
+    for (b = 0; b < AMD_TONE_BINS; b++) {
+        float c = vad->tone_coef[b], s1 = 0.0f, s2 = 0.0f, p;
+
+        for (i = 0; i < f->samples; i++) {
+            float s0 = (float)pcm[i] + c * s1 - s2;
+
+            s2 = s1;
+            s1 = s0;
+        }
+        p = s1 * s1 + s2 * s2 - c * s1 * s2;
+        if (p > peak) {
+            peak = p;
+        }
+    }
+
+    /* 2|X|^2 / N is the bin's share of the frame's energy */
+    tonal = 2.0f * peak >= 0.4f * energy * (float)f->samples;
+
+    if (!tonal) {
+        vad->tone_run = 0;
+    } else if (vad->tone_run && (score > vad->tone_level ? score - vad->tone_level : vad->tone_level - score) * 3 <= vad->tone_level) {
+        vad->tone_run++;
+        vad->tone_level = (vad->tone_level * 3 + score) / 4;
+    } else {
+        vad->tone_run = 1;
+        vad->tone_level = score;
+    }
+
+    return vad->tone_run >= AMD_TONE_FRAMES;
+}
+
+static switch_bool_t amd_handle_silence_frame(amd_vad_t *vad, const switch_frame_t *f)
+{
+    (void)f;
+    vad->silence_duration += vad->frame_ms;
+
+    if (vad->silence_duration >= vad->params.between_words_silence) {
+        if (vad->state != VAD_STATE_IN_SILENCE) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                              "AMD: Changed state to VAD_STATE_IN_SILENCE\n");
+        }
+        vad->state = VAD_STATE_IN_SILENCE;
+        vad->voice_duration = 0;
+        vad->run_logged = 0;
+    }
+
+    if (vad->in_initial_silence && vad->silence_duration >= vad->params.initial_silence) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: HUMAN (silence_duration: %u, initial_silence: %u)\n",
+                          vad->silence_duration, vad->params.initial_silence);
+        return amd_conclude(vad, "HUMAN", "INITIALSILENCE");
+    }
+
+    if (vad->silence_duration >= vad->params.after_greeting_silence && vad->in_greeting) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: HUMAN (silence_duration: %u, after_greeting_silence: %u)\n",
+                          vad->silence_duration, vad->params.after_greeting_silence);
+        return amd_conclude(vad, "HUMAN", "SILENCEAFTERGREETING");
+    }
+
+    return SWITCH_FALSE;
+}
+
+/*
+ * Timeline bookkeeping for a voiced frame. A run is logged on the frame the
+ * state machine counts it as a word, so AMD-Timeline matches AMD-Words: the
+ * run in progress at the start (state begins IN_WORD) is not one.
+ */
+static void amd_timeline_voiced(amd_vad_t *vad, const switch_frame_t *f)
+{
+    if (!vad->voice_duration) {
+        vad->run_start = vad->samples - f->samples;
+        vad->run_energy = 0;
+        vad->run_frames = 0;
+        vad->run_logged = 0;
+    }
+    vad->run_energy += vad->frame_score;
+    vad->run_frames++;
+
+    if (!vad->run_logged && vad->state == VAD_STATE_IN_SILENCE &&
+        vad->voice_duration + vad->frame_ms >= vad->params.minimum_word_length && vad->timeline_count < AMD_MAX_TIMELINE) {
+        vad->timeline[vad->timeline_count++].start = vad->run_start;
+        vad->run_logged = 1;
+    }
+    if (vad->run_logged) {
+        amd_word_t *w = &vad->timeline[vad->timeline_count - 1];
+
+        w->end = vad->samples;
+        w->energy = (uint32_t)(vad->run_energy / vad->run_frames);
+    }
+}
+
+static switch_bool_t amd_handle_voiced_frame(amd_vad_t *vad, const switch_frame_t *f)
+{
+    amd_timeline_voiced(vad, f);
+    vad->voice_duration += vad->frame_ms;
+
+    if (vad->voice_duration >= vad->params.minimum_word_length && vad->state == VAD_STATE_IN_SILENCE) {
+        vad->words++;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: Word detected (words: %u)\n", vad->words);
+        vad->state = VAD_STATE_IN_WORD;
+    }
+
+    if (vad->voice_duration >= vad->params.maximum_word_length) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: MACHINE (voice_duration: %u, maximum_word_length: %u)\n",
+                          vad->voice_duration, vad->params.maximum_word_length);
+        return amd_conclude(vad, "MACHINE", "MAXWORDLENGTH");
+    }
+
+    if (vad->words >= vad->params.maximum_number_of_words) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: MACHINE (words: %u, maximum_number_of_words: %u)\n",
+                          vad->words, vad->params.maximum_number_of_words);
+        return amd_conclude(vad, "MACHINE", "MAXWORDS");
+    }
+
+    if (vad->in_greeting && vad->voice_duration >= vad->params.greeting) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: MACHINE (voice_duration: %u, greeting: %u)\n",
+                          vad->voice_duration, vad->params.greeting);
+        return amd_conclude(vad, "MACHINE", "LONGGREETING");
+    }
+
+    if (vad->voice_duration >= vad->params.minimum_word_length) {
+        if (vad->silence_duration) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                              "AMD: Detected Talk, previous silence duration: %ums\n",
+                              vad->silence_duration);
+        }
+        vad->silence_duration = 0;
+    }
+
+    if (vad->voice_duration >= vad->params.minimum_word_length && !vad->in_greeting) {
+        if (vad->silence_duration) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                              "AMD: Before Greeting Time (silence_duration: %u, voice_duration: %u)\n",
+                              vad->silence_duration, vad->voice_duration);
+        }
+        vad->in_initial_silence = 0;
+        vad->in_greeting = 1;
+    }
+
+    return SWITCH_FALSE;
+}
+
+/* Out-of-band digits arrive through the session's recv_dtmf hook; the bug picks them up on its next frame */
+static switch_status_t amd_recv_dtmf_hook(switch_core_session_t *session, const switch_dtmf_t *dtmf, switch_dtmf_direction_t direction)
+{
+    amd_vad_t *vad = switch_channel_get_private(switch_core_session_get_channel(session), AMD_VAD_PRIVATE);
+    int none = 0;
+
+    if (vad && direction == SWITCH_DTMF_RECV) {
+        atomic_compare_exchange_strong(&vad->dtmf_digit, &none, (int)(unsigned char)dtmf->digit);
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* A keypress is conclusive, so it does not wait for the classifier */
+static void amd_dtmf_decide(amd_vad_t *vad, char digit, const char *how)
+{
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                      "AMD: HUMAN (%s DTMF '%c' after %ums)\n", how, digit, amd_elapsed_ms(vad));
+    amd_ext_stop(vad);
+    switch_channel_set_variable_printf(vad->channel, "amd_dtmf", "%c", digit);
+    amd_decide(vad, "HUMAN", "DTMF");
+}
+
+/*
+ * Answer arrived while analysing early media. A built-in verdict already held
+ * for the classifier stands; early_only calls give up; otherwise detection
+ * restarts from answer with the answered-call parameters.
+ */
+static switch_bool_t amd_handle_answer(amd_vad_t *vad)
+{
+    if (vad->held_result) {
+        amd_ext_stop(vad);
+        amd_decide(vad, vad->held_result, vad->held_cause);
+        return SWITCH_TRUE;
+    }
+
+    if (vad->params.early_only) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: NOTSURE (answered after %ums of early media)\n", amd_elapsed_ms(vad));
+        amd_ext_stop(vad);
+        amd_decide(vad, "NOTSURE", "ANSWERED");
+        return SWITCH_TRUE;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_INFO,
+                      "AMD: Answered after %ums of early media; restarting detection (set early_only=1 to stop instead)\n",
+                      amd_elapsed_ms(vad));
+    vad->early = 0;
+    vad->params = vad->answer_params;
+    vad->profile = vad->answer_profile;
+    switch_channel_set_variable(vad->channel, "amd_profile", vad->profile);
+    amd_vad_reset(vad);
+    return SWITCH_FALSE;
+}
+
+/* Publish the epoch and run the execute-on hook for the verdict, once per call */
+static void amd_finish(amd_vad_t *vad)
+{
+    const char *result = NULL;
+
+    if (vad->finished) {
+        return;
+    }
+    vad->finished = 1;
+
+    if (vad->held_result && !switch_channel_get_variable(vad->channel, "amd_result")) {
+        amd_decide(vad, vad->held_result, vad->held_cause);
+    }
+
+    switch_channel_set_variable(vad->channel, "amd_result_epoch",
+        switch_mprintf("%" SWITCH_TIME_T_FMT, switch_time_now() / 1000000));
+
+    result = switch_channel_get_variable(vad->channel, "amd_result");
+    if (result) {
+        if (!strcasecmp(result, "MACHINE")) {
+            switch_channel_execute_on(vad->channel, "amd_on_machine");
+        } else if (!strcasecmp(result, "HUMAN")) {
+            switch_channel_execute_on(vad->channel, "amd_on_human");
+        } else {
+            switch_channel_execute_on(vad->channel, "amd_on_notsure");
+        }
+    } else {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_WARNING,
+                          "No amd_result found; setting NOTSURE/TOOLONG\n");
+        amd_decide(vad, "NOTSURE", "TOOLONG");
+    }
+}
+
+/*
+ * Continuous monitoring: after the verdict of an answered call the bug stays
+ * attached and runs the plain state machine on every Nth frame, without a time
+ * limit. Only greeting-like MACHINE outcomes are reported (amd::monitor); any
+ * other outcome just starts a new round.
+ */
+static void amd_monitor_restart(amd_vad_t *vad)
+{
+    uint64_t samples = vad->samples;
+
+    amd_vad_reset(vad);
+    vad->samples = samples;
+    vad->sample_count_limit = 0;
+}
+
+static void amd_monitor_verdict(amd_vad_t *vad, const char *result, const char *cause)
+{
+    switch_event_t *event = NULL;
+
+    if (!strcmp(result, "MACHINE") && (!strcmp(cause, "LONGGREETING") || !strcmp(cause, "MAXWORDLENGTH"))) {
+        uint32_t elapsed = amd_elapsed_ms(vad);
+
+        vad->monitor_events++;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_INFO,
+                          "AMD: Monitor saw %s/%s at %ums\n", result, cause, elapsed);
+
+        switch_channel_set_variable(vad->channel, "amd_monitor_result", result);
+        switch_channel_set_variable(vad->channel, "amd_monitor_cause", cause);
+        switch_channel_set_variable_printf(vad->channel, "amd_monitor_ms", "%u", elapsed);
+
+        if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, AMD_EVENT_MONITOR) == SWITCH_STATUS_SUCCESS) {
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", switch_core_session_get_uuid(vad->session));
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Result", result);
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "AMD-Cause", cause);
+            switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Elapsed-Ms", "%u", elapsed);
+            switch_event_add_header(event, SWITCH_STACK_BOTTOM, "AMD-Monitor-Count", "%u", vad->monitor_events);
+            switch_event_fire(&event);
+        }
+        switch_channel_execute_on(vad->channel, "amd_on_monitor");
+    }
+
+    amd_monitor_restart(vad);
+}
+
+/* Called when a frame produced a verdict; SWITCH_TRUE keeps the bug for another round or monitoring */
+static switch_bool_t amd_after_verdict(amd_vad_t *vad)
+{
+    if (vad->round <= vad->params.rearm) {
+        amd_ext_stop(vad);
+        vad->round++;
+        if (vad->capture_results && !vad->capture) {
+            amd_capture_alloc(vad);
+        }
+        if (vad->early && switch_channel_test_flag(vad->channel, CF_ANSWERED)) {
+            vad->early = 0;
+            vad->params = vad->answer_params;
+            vad->profile = vad->answer_profile;
+        }
+        amd_vad_reset(vad);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: Re-armed for round %u of %u\n", vad->round, vad->params.rearm + 1);
+        return SWITCH_TRUE;
+    }
+
+    if (!vad->params.monitor || vad->early || !switch_channel_test_flag(vad->channel, CF_ANSWERED)) {
+        return SWITCH_FALSE;
+    }
+
+    amd_ext_stop(vad);
+    amd_finish(vad);
+    vad->monitoring = 1;
+    amd_monitor_restart(vad);
+
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                      "AMD: Monitoring every %u frame(s)\n", vad->params.monitor);
+    return SWITCH_TRUE;
+}
+
+static switch_bool_t amd_monitor_frame(amd_vad_t *vad, switch_frame_t *f)
+{
+    uint32_t n = vad->params.monitor;
+
+    if (!f->samples || ++vad->monitor_frames % n) {
+        return SWITCH_TRUE;
+    }
+
+    if (vad->stereo) {
+        int16_t *pcm = (int16_t *)f->data;
+        uint32_t i;
+
+        for (i = 0; i < f->samples; i++) {
+            pcm[i] = pcm[2 * i];    /* keep the read side, in place */
+        }
+    }
+
+    /* The analysed frame stands in for the n - 1 skipped ones */
+    vad->samples += (uint64_t)f->samples * n;
+    vad->frame_ms = n * 1000 / (vad->read_impl.actual_samples_per_second / f->samples);
+
+    if (classify_frame(vad->params.silence_threshold, f, &vad->frame_score) == SILENCE) {
+        amd_handle_silence_frame(vad, f);
+    } else {
+        amd_handle_voiced_frame(vad, f);
+    }
+
+    return SWITCH_TRUE;
+}
+
+/* Run one frame through the detector; SWITCH_FALSE once a verdict ends the bug */
+static switch_bool_t amd_process_frame(amd_vad_t *vad, const switch_frame_t *f)
+{
+    amd_frame_classifier class;
+    uint32_t n = vad->stride ? vad->stride : 1, tier = amd_vad_tier(vad);
+
+    if (!f->samples) {
+        return SWITCH_TRUE;
+    }
+
+    vad->samples += (uint64_t)f->samples * n;
+
+    if (vad->capture && tier < 1) {
+        amd_capture_frame(vad, (const int16_t *)f->data, f->samples);
+    }
+
+    /* The hook and detector are armed if either profile wants digits; only the current one decides */
+    if (atomic_load(&vad->dtmf_digit)) {
+        if (vad->params.dtmf) {
+            amd_dtmf_decide(vad, (char)atomic_load(&vad->dtmf_digit), "received");
+            return SWITCH_FALSE;
+        }
+        atomic_store(&vad->dtmf_digit, 0);
+    }
+
+    if (vad->dtmf_detect && vad->params.dtmf && tier < 1 && teletone_dtmf_detect(vad->dtmf_detect, (int16_t *)f->data, (int)f->samples) != TT_HIT_NONE) {
+        char digit[2] = { 0 };
+        unsigned int dur = 0;
+
+        if (teletone_dtmf_get(vad->dtmf_detect, digit, &dur)) {
+            amd_dtmf_decide(vad, digit[0], "inband");
+            return SWITCH_FALSE;
+        }
+        return SWITCH_TRUE;     /* tone frame: not speech, not silence */
+    }
+
+    if (amd_ext_active(vad) && amd_ext_process(vad, f)) {
+        return SWITCH_FALSE;
+    }
+
+    if (vad->held_result) {
+        return SWITCH_TRUE;     /* built-in verdict reached; waiting for the classifier */
+    }
+
+    if (vad->early && amd_tone_frame(vad, f)) {
+        return SWITCH_TRUE;     /* ringback or another call-progress tone: not speech, not silence */
+    }
+
+    if (vad->sample_count_limit) {
+        vad->sample_count_limit -= f->samples * n;
+        if (vad->sample_count_limit <= 0) {
+            return amd_conclude(vad, "NOTSURE", "TOOLONG") ? SWITCH_FALSE : SWITCH_TRUE;
+        }
+    }
+
+    vad->frame_ms = n * 1000 / (vad->read_impl.actual_samples_per_second / f->samples);
+
+    if (vad->ref) {
+        switch_bool_t prompt = SWITCH_FALSE;
+
+        class = amd_classify_with_prompt(vad, f, &prompt);
+        vad->talkover_ms = prompt && class == VOICED ? vad->talkover_ms + vad->frame_ms : 0;
+        if (vad->params.talkover && vad->talkover_ms >= vad->params.talkover) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                              "AMD: HUMAN (talkover: %ums, echo gain: %.2f)\n", vad->talkover_ms, vad->echo_gain);
+            return amd_conclude(vad, "HUMAN", "TALKOVER") ? SWITCH_FALSE : SWITCH_TRUE;
+        }
+    } else {
+        class = classify_frame(vad->params.silence_threshold, f, &vad->frame_score);
+    }
+
+    if (vad->frame_score > vad->peak_score) {
+        vad->peak_score = vad->frame_score;
+    }
+    if (class == SILENCE) {
+        vad->noise_sum += vad->frame_score;
+        vad->noise_frames++;
+    }
+
+    switch (class) {
+    case SILENCE:
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG, "AMD: Silence\n");
+        if (amd_handle_silence_frame(vad, f)) return SWITCH_FALSE;
+        break;
+    case VOICED:
+    default:
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG, "AMD: Voiced\n");
+        if (amd_handle_voiced_frame(vad, f)) return SWITCH_FALSE;
+        break;
+    }
+
+    /* Before answer a provisional verdict is only worth announcing when it leans MACHINE */
+    if (vad->params.fast_verdict && !vad->fast_result && amd_elapsed_ms(vad) >= vad->params.fast_verdict &&
+        (!vad->early || amd_machine_score(vad) > 50)) {
+        amd_fast_verdict(vad);
+    }
+
+    amd_progress(vad);
+    return SWITCH_TRUE;
+}
+
+/*
+ * Per-round CPU budget, measured in the READ_PING branch. Past half of
+ * cpu_budget_us the call drops to overload tier 2 (no optional stages,
+ * one frame in two); at the budget it ends with the verdict held for the
+ * external classifier, if any, or NOTSURE/CPUBUDGET, without waiting. Returns
+ * SWITCH_TRUE once the verdict is given.
+ */
+static switch_bool_t amd_cpu_budget(amd_vad_t *vad)
+{
+    uint64_t used = vad->cpu_ns - vad->budget_base, budget = (uint64_t)vad->params.cpu_budget_us * 1000;
+
+    if (used >= budget) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_NOTICE,
+                          "AMD: CPU budget of %uus spent after %ums\n", vad->params.cpu_budget_us, amd_elapsed_ms(vad));
+        amd_ext_stop(vad);
+        if (vad->held_result) {
+            amd_decide(vad, vad->held_result, vad->held_cause);
+        } else {
+            amd_decide(vad, "NOTSURE", "CPUBUDGET");
+        }
+        return SWITCH_TRUE;
+    }
+
+    if (used * 2 >= budget && vad->budget_degrade < 2) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
+                          "AMD: Half of the CPU budget spent; degrading\n");
+        vad->budget_degrade = 2;
+    }
+
+    return SWITCH_FALSE;
+}
+
+static switch_bool_t amd_read_ping(amd_vad_t *vad, switch_media_bug_t *bug)
+{
+    uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
+    int16_t mono[SWITCH_RECOMMENDED_BUFFER_SIZE / 4], ref[SWITCH_RECOMMENDED_BUFFER_SIZE / 4];
+    switch_frame_t read_frame = { 0 };
+    switch_status_t status;
+
+    read_frame.data = data;
+    read_frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+
+    status = switch_core_media_bug_read(bug, &read_frame, SWITCH_FALSE);
+    if (status != SWITCH_STATUS_SUCCESS && status != SWITCH_STATUS_BREAK) {
+        return SWITCH_TRUE;
+    }
+
+    if (vad->monitoring) {
+        return amd_monitor_frame(vad, &read_frame);
+    }
 
-    for (energy = 0, j = 0, count = 0; count < f->samples; count++) {
-        energy += abs(audio[j++]);
+    if (vad->params.cpu_budget_us && amd_cpu_budget(vad)) {
+        return amd_after_verdict(vad);
     }
-    score = (uint32_t)(energy / (f->samples));
 
-    return (score >= silence_threshold) ? VOICED : SILENCE;
-}
+    if (vad->stereo) {
+        /* read on the left, our write stream on the right */
+        int16_t *pcm = (int16_t *)data;
+        uint32_t i;
 
-static switch_bool_t amd_handle_silence_frame(amd_vad_t *vad, const switch_frame_t *f)
-{
-    (void)f;
-    vad->silence_duration += vad->frame_ms;
+        for (i = 0; i < read_frame.samples; i++) {
+            mono[i] = pcm[2 * i];
+            ref[i] = pcm[2 * i + 1];
+        }
+        read_frame.data = mono;
+        read_frame.datalen = read_frame.samples * sizeof(int16_t);
+        read_frame.channels = 1;
 
-    if (vad->silence_duration >= vad->params.between_words_silence) {
-        if (vad->state != VAD_STATE_IN_SILENCE) {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                              "AMD: Changed state to VAD_STATE_IN_SILENCE\n");
+        if (vad->aec && amd_vad_tier(vad) < 1) {
+            amd_aec_process(vad->aec, mono, ref, read_frame.samples);
+        } else if (vad->aec) {
+            amd_aec_skip(vad->aec, ref, read_frame.samples);
         }
-        vad->state = VAD_STATE_IN_SILENCE;
-        vad->voice_duration = 0;
     }
 
-    if (vad->in_initial_silence && vad->silence_duration >= vad->params.initial_silence) {
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                          "AMD: HUMAN (silence_duration: %u, initial_silence: %u)\n",
-                          vad->silence_duration, vad->params.initial_silence);
-        switch_channel_set_variable(vad->channel, "amd_result", "HUMAN");
-        switch_channel_set_variable(vad->channel, "amd_cause", "INITIALSILENCE");
-        amd_fire_event("HUMAN", "INITIALSILENCE", vad->session);
-        return SWITCH_TRUE;
+    if (vad->early && switch_channel_test_flag(vad->channel, CF_ANSWERED) && amd_handle_answer(vad)) {
+        return amd_after_verdict(vad);
     }
 
-    if (vad->silence_duration >= vad->params.after_greeting_silence && vad->in_greeting) {
+    if (vad->preroll) {
+        switch_frame_t replay = { 0 };
+        uint32_t off, step = read_frame.samples ? read_frame.samples : vad->read_impl.actual_samples_per_second / 50;
+
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                          "AMD: HUMAN (silence_duration: %u, after_greeting_silence: %u)\n",
-                          vad->silence_duration, vad->params.after_greeting_silence);
-        switch_channel_set_variable(vad->channel, "amd_result", "HUMAN");
-        switch_channel_set_variable(vad->channel, "amd_cause", "SILENCEAFTERGREETING");
-        amd_fire_event("HUMAN", "SILENCEAFTERGREETING", vad->session);
+                          "AMD: Replaying %ums of pre-roll audio\n",
+                          vad->preroll_samples * 1000 / vad->read_impl.actual_samples_per_second);
+
+        for (off = 0; off < vad->preroll_samples; off += step) {
+            replay.data = vad->preroll + off;
+            replay.samples = vad->preroll_samples - off < step ? vad->preroll_samples - off : step;
+            replay.datalen = replay.samples * sizeof(int16_t);
+            if (!amd_process_frame(vad, &replay)) {
+                vad->preroll = NULL;
+                return amd_after_verdict(vad);
+            }
+        }
+        vad->preroll = NULL;
+    }
+
+    /* Tier 2: drain skipped frames; the next analysed one stands in for them */
+    if (amd_vad_tier(vad) >= 2 && vad->skipped + 1 < AMD_OVERLOAD_STRIDE) {
+        vad->skipped++;
         return SWITCH_TRUE;
     }
+    vad->stride = vad->skipped + 1;
+    vad->skipped = 0;
 
-    return SWITCH_FALSE;
+    vad->ref = vad->stereo ? ref : NULL;
+    return amd_process_frame(vad, &read_frame) ? SWITCH_TRUE : amd_after_verdict(vad);
 }
 
-static switch_bool_t amd_handle_voiced_frame(amd_vad_t *vad, const switch_frame_t *f)
+/*
+ * Admission control: take a node-wide slot (max_sessions) and a slot in the
+ * call's campaign (campaign_max_sessions, lowered per call by
+ * amd_campaign_max_sessions on the channel) with an atomic increment,
+ * backing out if either is over its limit. Campaign slots live in the
+ * call's rates key; a campaign without one (rates_keys=0, or a full table)
+ * is let through, logged and counted in admission_unchecked. Slots are
+ * given back when the bug closes.
+ */
+static switch_bool_t amd_admission_take(amd_vad_t *vad)
 {
-    (void)f;
-    vad->voice_duration += vad->frame_ms;
+    const char *v = switch_channel_get_variable(vad->channel, "amd_campaign_max_sessions");
+    uint32_t quota = amd.campaign_max_sessions;
+    int lower = !zstr(v) ? atoi(v) : 0;
 
-    if (vad->voice_duration >= vad->params.minimum_word_length && vad->state == VAD_STATE_IN_SILENCE) {
-        vad->words++;
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                          "AMD: Word detected (words: %u)\n", vad->words);
-        vad->state = VAD_STATE_IN_WORD;
+    if (lower > 0 && (!quota || (uint32_t)lower < quota)) {
+        quota = (uint32_t)lower;
     }
 
-    if (vad->voice_duration >= vad->params.maximum_word_length) {
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                          "AMD: MACHINE (voice_duration: %u, maximum_word_length: %u)\n",
-                          vad->voice_duration, vad->params.maximum_word_length);
-        switch_channel_set_variable(vad->channel, "amd_result", "MACHINE");
-        switch_channel_set_variable(vad->channel, "amd_cause", "MAXWORDLENGTH");
-        amd_fire_event("MACHINE", "MAXWORDLENGTH", vad->session);
-        return SWITCH_TRUE;
+    if (atomic_fetch_add(&amd.active_sessions, 1) >= amd.max_sessions && amd.max_sessions) {
+        atomic_fetch_sub(&amd.active_sessions, 1);
+        return SWITCH_FALSE;
     }
-
-    if (vad->words >= vad->params.maximum_number_of_words) {
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                          "AMD: MACHINE (words: %u, maximum_number_of_words: %u)\n",
-                          vad->words, vad->params.maximum_number_of_words);
-        switch_channel_set_variable(vad->channel, "amd_result", "MACHINE");
-        switch_channel_set_variable(vad->channel, "amd_cause", "MAXWORDS");
-        amd_fire_event("MACHINE", "MAXWORDS", vad->session);
-        return SWITCH_TRUE;
+    if (quota && vad->campaign && !vad->campaign_rates) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_WARNING,
+                          "AMD: No rates key for campaign [%s]; its quota of %u is not enforced\n", vad->campaign, quota);
+        atomic_fetch_add(&amd.admission_unchecked, 1);
     }
-
-    if (vad->in_greeting && vad->voice_duration >= vad->params.greeting) {
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                          "AMD: MACHINE (voice_duration: %u, greeting: %u)\n",
-                          vad->voice_duration, vad->params.greeting);
-        switch_channel_set_variable(vad->channel, "amd_result", "MACHINE");
-        switch_channel_set_variable(vad->channel, "amd_cause", "LONGGREETING");
-        amd_fire_event("MACHINE", "LONGGREETING", vad->session);
-        return SWITCH_TRUE;
+    if (vad->campaign_rates && atomic_fetch_add(&vad->campaign_rates->active, 1) >= quota && quota) {
+        atomic_fetch_sub(&vad->campaign_rates->active, 1);
+        atomic_fetch_sub(&amd.active_sessions, 1);
+        return SWITCH_FALSE;
     }
+    vad->admitted = 1;
 
-    if (vad->voice_duration >= vad->params.minimum_word_length) {
-        if (vad->silence_duration) {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                              "AMD: Detected Talk, previous silence duration: %ums\n",
-                              vad->silence_duration);
-        }
-        vad->silence_duration = 0;
+    return SWITCH_TRUE;
+}
+
+/* Over capacity with admission_fallback=lite: take one of lite_max_sessions slots */
+static switch_bool_t amd_admission_take_lite(amd_vad_t *vad)
+{
+    if (atomic_fetch_add(&amd.lite_sessions, 1) >= amd.lite_max_sessions) {
+        atomic_fetch_sub(&amd.lite_sessions, 1);
+        return SWITCH_FALSE;
     }
+    vad->lite = 1;
 
-    if (vad->voice_duration >= vad->params.minimum_word_length && !vad->in_greeting) {
-        if (vad->silence_duration) {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG,
-                              "AMD: Before Greeting Time (silence_duration: %u, voice_duration: %u)\n",
-                              vad->silence_duration, vad->voice_duration);
-        }
-        vad->in_initial_silence = 0;
-        vad->in_greeting = 1;
+    return SWITCH_TRUE;
+}
+
+static void amd_admission_release(amd_vad_t *vad)
+{
+    if (vad->lite) {
+        vad->lite = 0;
+        atomic_fetch_sub(&amd.lite_sessions, 1);
+    }
+    if (!vad->admitted) {
+        return;
+    }
+    vad->admitted = 0;
+    atomic_fetch_sub(&amd.active_sessions, 1);
+    if (vad->campaign_rates) {
+        atomic_fetch_sub(&vad->campaign_rates->active, 1);
     }
+}
 
-    return SWITCH_FALSE;
+/* Unpin the call's rates keys once it can no longer record a verdict */
+static void amd_rates_release(amd_vad_t *vad)
+{
+    amd_rates_unpin(vad->campaign_rates);
+    amd_rates_unpin(vad->gateway_rates);
+    vad->campaign_rates = NULL;
+    vad->gateway_rates = NULL;
 }
 
 static switch_bool_t amd_read_audio_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type)
@@ -306,72 +5182,60 @@ static switch_bool_t amd_read_audio_callback(switch_media_bug_t *bug, void *user
         if (vad->params.total_analysis_time) {
             vad->sample_count_limit = (vad->read_impl.actual_samples_per_second / 1000) * vad->params.total_analysis_time;
         }
+        if (vad->params.classifier_deadline && (vad->ext_call_id = amd_ext_open())) {
+            amd_ext_send(vad->ext_call_id, AMD_EXT_START, NULL, 0, vad->read_impl.actual_samples_per_second,
+                         switch_core_session_get_uuid(vad->session));
+        }
+        if (vad->params.classifier_deadline) {
+            vad->shm_session = amd_shm_open(vad->read_impl.actual_samples_per_second,
+                                            switch_core_session_get_uuid(vad->session), &vad->shm_generation);
+        }
+        vad->preroll = amd_preroll_take(vad->session, vad->read_impl.actual_samples_per_second, &vad->preroll_samples);
+        if (vad->capture_results) {
+            vad->capture_size = vad->read_impl.actual_samples_per_second * (amd.capture_seconds ? amd.capture_seconds : 10);
+            amd_capture_alloc(vad);
+        }
+        if (vad->params.dtmf || vad->answer_params.dtmf) {
+            vad->dtmf_detect = switch_core_session_alloc(vad->session, sizeof(*vad->dtmf_detect));
+            teletone_dtmf_detect_init(vad->dtmf_detect, vad->read_impl.actual_samples_per_second);
+            switch_channel_set_private(vad->channel, AMD_VAD_PRIVATE, vad);
+            switch_core_event_hook_add_recv_dtmf(vad->session, amd_recv_dtmf_hook);
+        }
+        amd_stats_add(&amd_stats_shard()->started, 1);
         break;
     }
     case SWITCH_ABC_TYPE_CLOSE: {
-        const char *result = NULL;
+        amd_ext_stop(vad);
+        switch_safe_free(vad->capture);
+        amd_stats_add(&amd_stats_shard()->stopped, 1);
+        amd_admission_release(vad);
+
+        if (vad->dtmf_detect) {
+            switch_core_event_hook_remove_recv_dtmf(vad->session, amd_recv_dtmf_hook);
+            switch_channel_set_private(vad->channel, AMD_VAD_PRIVATE, NULL);
+        }
 
         if (switch_channel_ready(vad->channel)) {
-            switch_channel_set_variable(vad->channel, "amd_result_epoch",
-                switch_mprintf("%" SWITCH_TIME_T_FMT, switch_time_now() / 1000000));
-
-            result = switch_channel_get_variable(vad->channel, "amd_result");
-            if (result) {
-                if (!strcasecmp(result, "MACHINE")) {
-                    switch_channel_execute_on(vad->channel, "amd_on_machine");
-                } else if (!strcasecmp(result, "HUMAN")) {
-                    switch_channel_execute_on(vad->channel, "amd_on_human");
-                } else {
-                    switch_channel_execute_on(vad->channel, "amd_on_notsure");
-                }
-            } else {
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_WARNING,
-                                  "No amd_result found; setting NOTSURE/TOOLONG\n");
-                switch_channel_set_variable(vad->channel, "amd_result", "NOTSURE");
-                switch_channel_set_variable(vad->channel, "amd_cause", "TOOLONG");
-                amd_fire_event("NOTSURE", "TOOLONG", vad->session);
-            }
+            amd_finish(vad);
         }
+        amd_rates_release(vad);
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG, "AMD: close\n");
         break;
     }
     case SWITCH_ABC_TYPE_READ_PING: {
-        uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
-        switch_frame_t read_frame = { 0 };
-        switch_status_t status;
-
-        read_frame.data = data;
-        read_frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
-
-        status = switch_core_media_bug_read(bug, &read_frame, SWITCH_FALSE);
-        if (status != SWITCH_STATUS_SUCCESS && status != SWITCH_STATUS_BREAK) {
-            return SWITCH_TRUE;
-        }
-
-        if (vad->sample_count_limit) {
-            vad->sample_count_limit -= read_frame.samples;
-            if (vad->sample_count_limit <= 0) {
-                switch_channel_set_variable(vad->channel, "amd_result", "NOTSURE");
-                switch_channel_set_variable(vad->channel, "amd_cause", "TOOLONG");
-                amd_fire_event("NOTSURE", "TOOLONG", vad->session);
-                return SWITCH_FALSE;
-            }
-        }
+        uint64_t t0 = amd_now_ns();
+        switch_bool_t ret = amd_read_ping(vad, bug);
+        uint64_t spent = amd_now_ns() - t0;
+        amd_stats_shard_t *shard = amd_stats_shard();
 
-        vad->frame_ms = 1000 / (vad->read_impl.actual_samples_per_second / read_frame.samples);
-
-        switch (classify_frame(vad->params.silence_threshold, &read_frame, &vad->read_impl)) {
-        case SILENCE:
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG, "AMD: Silence\n");
-            if (amd_handle_silence_frame(vad, &read_frame)) return SWITCH_FALSE;
-            break;
-        case VOICED:
-        default:
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_DEBUG, "AMD: Voiced\n");
-            if (amd_handle_voiced_frame(vad, &read_frame)) return SWITCH_FALSE;
-            break;
+        vad->cpu_ns += spent;
+        vad->frames++;
+        amd_stats_add(&shard->cpu_ns, spent);
+        /* A frame drained at tier 2 is charged to the next analysed one, so ns/frame stays per full frame */
+        if (!vad->skipped) {
+            amd_stats_add(&shard->frames, 1);
         }
-        break;
+        return ret;
     }
     default:
         break;
@@ -384,6 +5248,17 @@ static switch_bool_t amd_read_audio_callback(switch_media_bug_t *bug, void *user
    Dialplan application
    ------------------------- */
 
+/* Give an immediate NOTSURE without attaching the bug; amd_admission tells the API why */
+static void amd_refuse(amd_vad_t *vad, const char *cause)
+{
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(vad->session), SWITCH_LOG_WARNING, "AMD: Not started: NOTSURE/%s\n", cause);
+    vad->refused = 1;
+    switch_channel_set_variable(vad->channel, "amd_admission", cause);
+    amd_decide(vad, "NOTSURE", cause);
+    amd_finish(vad);
+    amd_rates_release(vad);
+}
+
 SWITCH_STANDARD_APP(amd_start_function)
 {
     switch_channel_t *channel = switch_core_session_get_channel(session);
@@ -392,6 +5267,10 @@ SWITCH_STANDARD_APP(amd_start_function)
 
     char *arg = (char *)data;
     char delim = ' ';
+    int x, argc = 0;
+    char *argv[16] = { 0 };
+    const char *profile_name = NULL;
+    amd_profile_t *profile = NULL;
 
     amd_vad_t *vad = NULL;
 
@@ -400,7 +5279,6 @@ SWITCH_STANDARD_APP(amd_start_function)
     }
 
     vad = switch_core_session_alloc(session, sizeof(*vad));
-    vad->params = globals;
     vad->channel = channel;
     vad->session = session;
     vad->state = VAD_STATE_IN_WORD;
@@ -410,6 +5288,7 @@ SWITCH_STANDARD_APP(amd_start_function)
     vad->in_initial_silence = 1;
     vad->in_greeting = 0;
     vad->words = 0;
+    vad->round = 1;
 
     /* Parse inline overrides: key=value;key=value... (space or custom delim via ^^X) */
     if (!zstr(arg) && *arg == '^' && *(arg+1) == '^') {
@@ -418,44 +5297,163 @@ SWITCH_STANDARD_APP(amd_start_function)
     }
 
     if (arg && *arg) {
-        int x, argc;
-        char *argv[16] = { 0 };
-        char *param[2] = { 0 };
         char *work = switch_core_session_strdup(session, arg);
         /* allow semicolon- or space-separated list */
-        for (char *p = work; *p; ++p) { if (*p == ';' || *p == ',') *p = ' '; }
+        for (char *p = work; *p; ++p) { if (*p == ';' || *p == ',' || *p == delim) *p = ' '; }
 
         argc = switch_separate_string(work, ' ', argv, (int)switch_arraylen(argv));
         for (x = 0; x < argc; x++) {
-            if (switch_separate_string(argv[x], '=', param, (int)switch_arraylen(param)) == 2) {
-                int value = atoi(param[1]);
-                if (value > 0) {
-                    if (!strcasecmp(param[0], "initial_silence"))        vad->params.initial_silence = value;
-                    else if (!strcasecmp(param[0], "greeting"))           vad->params.greeting = value;
-                    else if (!strcasecmp(param[0], "after_greeting_silence")) vad->params.after_greeting_silence = value;
-                    else if (!strcasecmp(param[0], "total_analysis_time"))    vad->params.total_analysis_time = value;
-                    else if (!strcasecmp(param[0], "min_word_length"))        vad->params.minimum_word_length = value;
-                    else if (!strcasecmp(param[0], "between_words_silence"))  vad->params.between_words_silence = value;
-                    else if (!strcasecmp(param[0], "maximum_number_of_words")) vad->params.maximum_number_of_words = value;
-                    else if (!strcasecmp(param[0], "maximum_word_length"))    vad->params.maximum_word_length = value;
-                    else if (!strcasecmp(param[0], "silence_threshold"))      vad->params.silence_threshold = value;
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "AMD: Apply [%s]=[%d]\n", param[0], value);
-                } else {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
-                                      "AMD: Invalid [%s]=[%s]; must be positive integer.\n", param[0], param[1]);
-                }
+            if (!strncasecmp(argv[x], "profile=", 8)) {
+                profile_name = argv[x] + 8;
+            }
+        }
+    }
+
+    /* Base parameters: named profile, destination prefix, bandit choice, or <settings> */
+    switch_thread_rwlock_rdlock(amd.config_lock);
+    if (profile_name && !(profile = amd_profile_find(amd.config, profile_name))) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                          "AMD: Unknown profile [%s]; using defaults\n", profile_name);
+    }
+    if (!zstr(amd.prefix_variable)) {
+        vad->destination = switch_channel_get_variable(channel, amd.prefix_variable);
+    } else {
+        switch_caller_profile_t *cp = switch_channel_get_caller_profile(channel);
+        vad->destination = cp ? cp->destination_number : NULL;
+    }
+    vad->destination = vad->destination ? switch_core_session_strdup(session, vad->destination) : NULL;
+    if (!zstr(amd.campaign_variable) && !zstr(vad->campaign = switch_channel_get_variable(channel, amd.campaign_variable))) {
+        vad->campaign = switch_core_session_strdup(session, vad->campaign);
+        vad->campaign_rates = amd_rates_key('c', vad->campaign, SWITCH_TRUE);
+    }
+    vad->gateway_rates = amd_rates_key('g', switch_channel_get_variable(channel, "sip_gateway_name"), SWITCH_TRUE);
+    /* Capture sampling is decided here so unsampled calls never fill a ring */
+    if (amd.capture_thread && !zstr(amd.capture_results) &&
+        amd_cache_hash(switch_core_session_get_uuid(session)) % 100 < amd.capture_rate) {
+        vad->capture_results = switch_core_session_strdup(session, amd.capture_results);
+    }
+
+    if (!profile && !profile_name && (profile = amd_trie_lookup(amd.config, vad->destination))) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+                          "AMD: Destination [%s] matched profile [%s]\n", vad->destination, profile->name);
+    }
+    if (!profile && !profile_name && !strcasecmp(amd.profile_selection, "ucb")) {
+        profile = amd_bandit_select(amd.config);
+    }
+    if (profile) {
+        vad->params = profile->params;
+        vad->profile = switch_core_session_strdup(session, profile->name);
+    } else {
+        vad->params = globals;
+    }
+
+    /* Started in early media: use early_media_profile until answer, unless a profile was named */
+    if (!switch_channel_test_flag(channel, CF_ANSWERED)) {
+        amd_profile_t *early = NULL;
+
+        vad->early = 1;
+        vad->answer_params = vad->params;
+        vad->answer_profile = vad->profile;
+        if (!profile_name && !zstr(amd.early_media_profile) && (early = amd_profile_find(amd.config, amd.early_media_profile))) {
+            vad->params = early->params;
+            vad->profile = switch_core_session_strdup(session, early->name);
+        }
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+                          "AMD: Starting in early media with profile [%s]\n", vad->profile ? vad->profile : "default");
+    }
+    switch_thread_rwlock_unlock(amd.config_lock);
+
+    for (x = 0; x < argc; x++) {
+        char *param[2] = { 0 };
+
+        if (!strncasecmp(argv[x], "profile=", 8)) {
+            continue;
+        }
+
+        if (switch_separate_string(argv[x], '=', param, (int)switch_arraylen(param)) == 2) {
+            if (vad->early) {
+                amd_params_set(&vad->answer_params, param[0], param[1]);
+            }
+            if (amd_params_set(&vad->params, param[0], param[1]) != SWITCH_STATUS_FALSE) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "AMD: Apply [%s]=[%d]\n", param[0], atoi(param[1]));
             } else {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Ignored arg [%s]\n", argv[x]);
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                                  "AMD: Invalid [%s]=[%s]; must be positive integer.\n", param[0], param[1]);
+            }
+        } else {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AMD: Ignored arg [%s]\n", argv[x]);
+        }
+    }
+
+    switch_channel_set_variable(channel, "amd_profile", vad->profile);
+
+    /* Redial history: publish it and optionally shorten the window for known machines */
+    {
+        amd_cache_entry_t hist;
+
+        if (amd_cache_lookup(vad->destination, &hist)) {
+            switch_channel_set_variable(channel, "amd_history_result", hist.result);
+            switch_channel_set_variable(channel, "amd_history_cause", hist.cause);
+            switch_channel_set_variable_printf(channel, "amd_history_count", "%u", hist.count);
+
+            if (!strcmp(hist.result, "MACHINE") && vad->params.cached_machine_analysis_time &&
+                (!vad->params.total_analysis_time || vad->params.cached_machine_analysis_time < vad->params.total_analysis_time)) {
+                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG,
+                                  "AMD: History says MACHINE; total_analysis_time %u -> %u\n",
+                                  vad->params.total_analysis_time, vad->params.cached_machine_analysis_time);
+                vad->params.total_analysis_time = vad->params.cached_machine_analysis_time;
+            }
+            if (vad->early && !strcmp(hist.result, "MACHINE") && vad->answer_params.cached_machine_analysis_time &&
+                (!vad->answer_params.total_analysis_time ||
+                 vad->answer_params.cached_machine_analysis_time < vad->answer_params.total_analysis_time)) {
+                vad->answer_params.total_analysis_time = vad->answer_params.cached_machine_analysis_time;
             }
+        } else {
+            switch_channel_set_variable(channel, "amd_history_result", NULL);
+            switch_channel_set_variable(channel, "amd_history_cause", NULL);
+            switch_channel_set_variable(channel, "amd_history_count", NULL);
         }
     }
 
+    /* Talk-over detection and echo cancelling need our own prompt audio alongside the callee's */
+    if (vad->params.talkover || vad->answer_params.talkover || vad->params.aec_taps || vad->answer_params.aec_taps) {
+        flags |= SMBF_WRITE_STREAM | SMBF_STEREO;
+        vad->stereo = 1;
+        vad->echo_gain = 0.5f;      /* -6 dB, the worst echo return loss G.168 plans for */
+    }
+    if (vad->params.aec_taps || vad->answer_params.aec_taps) {
+        vad->aec = amd_aec_create(session, vad->params.aec_taps > vad->answer_params.aec_taps ?
+                                  vad->params.aec_taps : vad->answer_params.aec_taps);
+    }
+
+    switch_channel_set_variable(channel, "amd_admission", NULL);
+    if (amd_overload_tier() >= 3) {
+        amd_refuse(vad, "OVERLOAD");
+        return;
+    }
+
     if (!switch_channel_media_up(channel) || !switch_core_session_get_read_codec(session)) {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                           "Cannot start AMD. Media is not up on channel.\n");
+        amd_rates_release(vad);
         return;
     }
 
+    if (!amd_admission_take(vad)) {
+        if (amd.fallback != AMD_FALLBACK_LITE || !amd_admission_take_lite(vad)) {
+            amd_refuse(vad, "CAPACITY");
+            return;
+        }
+        /* Over capacity: run in a lite slot, without the external classifier and at overload tier 2 */
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "AMD: Over capacity; starting in lite mode\n");
+        vad->degrade = 2;
+        vad->params.classifier_deadline = 0;
+        vad->answer_params.classifier_deadline = 0;
+        switch_channel_set_variable(channel, "amd_admission", "LITE");
+    } else {
+        switch_channel_set_variable(channel, "amd_admission", "OK");
+    }
+
     if (switch_core_media_bug_add(session,
                                   BUG_AMD_NAME_READ,
                                   NULL,
@@ -466,6 +5464,8 @@ SWITCH_STANDARD_APP(amd_start_function)
                                   &bug) != SWITCH_STATUS_SUCCESS) {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
                           "Failed to add media bug for AMD.\n");
+        amd_admission_release(vad);
+        amd_rates_release(vad);
         return;
     }
 }
@@ -524,6 +5524,8 @@ SWITCH_STANDARD_API(uuid_amd_detect_function)
 
     do {
         switch_channel_t *channel = switch_core_session_get_channel(ts);
+        const char *admission;
+
         if (!switch_channel_ready(channel) || !switch_channel_media_up(channel)) {
             stream->write_function(stream, "-ERR Channel not ready (no media)\n");
             break;
@@ -535,6 +5537,16 @@ SWITCH_STANDARD_API(uuid_amd_detect_function)
             break;
         }
 
+        admission = switch_channel_get_variable(channel, "amd_admission");
+        if (admission && !strcmp(admission, "CAPACITY")) {
+            stream->write_function(stream, "-ERR AMD capacity\n");
+            break;
+        }
+        if (admission && !strcmp(admission, "OVERLOAD")) {
+            stream->write_function(stream, "-ERR AMD overload\n");
+            break;
+        }
+
         stream->write_function(stream, "+OK AMD detection started\n");
     } while (0);
 
@@ -543,6 +5555,160 @@ SWITCH_STANDARD_API(uuid_amd_detect_function)
     return SWITCH_STATUS_SUCCESS;
 }
 
+SWITCH_STANDARD_API(amd_feedback_function)
+{
+    /* Syntax:
+     *   amd_feedback <profile> <correct|incorrect> <decision_ms>
+     *
+     * Reports the verified outcome of a call that used a bandit profile;
+     * profile and decision_ms are the amd_profile / amd_decision_ms
+     * channel variables (or AMD-Profile / AMD-Decision-Ms event headers).
+     */
+    char *dup = NULL;
+    char *argv[3] = { 0 };
+    amd_profile_t *profile;
+
+    (void)session;
+
+    if (zstr(cmd) || !(dup = strdup(cmd)) ||
+        switch_separate_string(dup, ' ', argv, (int)switch_arraylen(argv)) != 3 ||
+        (strcasecmp(argv[1], "correct") && strcasecmp(argv[1], "incorrect"))) {
+        stream->write_function(stream, "-ERR Usage: amd_feedback <profile> <correct|incorrect> <decision_ms>\n");
+        switch_safe_free(dup);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    switch_thread_rwlock_rdlock(amd.config_lock);
+    if ((profile = amd_profile_find(amd.config, argv[0])) && profile->arm >= 0) {
+        amd_bandit_feedback(profile, !strcasecmp(argv[1], "correct"), (uint32_t)atoi(argv[2]));
+        stream->write_function(stream, "+OK\n");
+    } else {
+        stream->write_function(stream, "-ERR No bandit profile %s\n", argv[0]);
+    }
+    switch_thread_rwlock_unlock(amd.config_lock);
+
+    free(dup);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(amd_cache_function)
+{
+    /* Syntax:
+     *   amd_cache stats
+     *   amd_cache lookup <number>
+     */
+    amd_cache_entry_t hist;
+
+    (void)session;
+
+    if (!amd_cache_enabled()) {
+        stream->write_function(stream, "-ERR Result cache disabled (cache_entries=0)\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (zstr(cmd) || !strcasecmp(cmd, "stats")) {
+        stream->write_function(stream, "mode: %s\nhits: %" PRIu64 "\nmisses: %" PRIu64 "\nstores: %" PRIu64 "\nevictions: %" PRIu64 "\ncapacity: %u\n",
+                               amd.cache_shm ? "shm" : "private",
+                               (uint64_t)atomic_load(&amd.cache_hits), (uint64_t)atomic_load(&amd.cache_misses),
+                               (uint64_t)atomic_load(&amd.cache_stores), (uint64_t)atomic_load(&amd.cache_evictions),
+                               amd.cache_shm ? amd.cache_shm->slots : amd.cache_shard_count * amd.cache_shard_slots);
+        if (amd.cache_shm) {
+            stream->write_function(stream, "host_stores: %" PRIu64 "\nhost_evictions: %" PRIu64 "\n",
+                                   (uint64_t)atomic_load(&amd.cache_shm->stores), (uint64_t)atomic_load(&amd.cache_shm->evictions));
+        }
+    } else if (!strncasecmp(cmd, "lookup ", 7)) {
+        if (amd_cache_lookup(cmd + 7, &hist)) {
+            stream->write_function(stream, "%s %s count=%u age=%us\n", hist.result, hist.cause, hist.count,
+                                   (uint32_t)switch_epoch_time_now(NULL) - hist.stored);
+        } else {
+            stream->write_function(stream, "-ERR Not found\n");
+        }
+    } else {
+        stream->write_function(stream, "-ERR Usage: amd_cache stats|lookup <number>\n");
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(amd_rates_function)
+{
+    /* Syntax:
+     *   amd_rates [<campaign>] [seconds]
+     *   amd_rates gateway <name> [seconds]
+     */
+    char *dup = NULL, *argv[4] = { 0 };
+    int argc = 0;
+    uint32_t i;
+    amd_rate_key_t *k;
+
+    (void)session;
+
+    if (!amd.rate_keys || !amd.rates_window) {
+        stream->write_function(stream, "-ERR Rates disabled (rates_window=0)\n");
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!zstr(cmd) && (dup = strdup(cmd))) {
+        argc = switch_separate_string(dup, ' ', argv, (int)switch_arraylen(argv));
+    }
+
+    if (!argc) {
+        uint32_t used = 0;
+
+        for (i = 0; i < amd.rates_keys; i++) {
+            if (atomic_load_explicit(&amd.rate_keys[i].ready, memory_order_acquire)) {
+                amd_rates_print(stream, &amd.rate_keys[i], 0);
+                used++;
+            }
+        }
+        stream->write_function(stream, "table keys=%u/%u full=%" PRIu64 " evicted=%" PRIu64 "\n", used, amd.rates_keys,
+                               (uint64_t)atomic_load(&amd.rates_full), (uint64_t)atomic_load(&amd.rates_evicted));
+    } else if (!strcasecmp(argv[0], "gateway")) {
+        if (argc < 2) {
+            stream->write_function(stream, "-ERR Usage: amd_rates [<campaign>|gateway <name>] [seconds]\n");
+        } else if ((k = amd_rates_key('g', argv[1], SWITCH_FALSE)) && atomic_load(&k->ready)) {
+            amd_rates_print(stream, k, argc > 2 ? (uint32_t)atoi(argv[2]) : 0);
+        } else {
+            stream->write_function(stream, "-ERR Not found\n");
+        }
+    } else if ((k = amd_rates_key('c', argv[0], SWITCH_FALSE)) && atomic_load(&k->ready)) {
+        amd_rates_print(stream, k, argc > 1 ? (uint32_t)atoi(argv[1]) : 0);
+    } else {
+        stream->write_function(stream, "-ERR Not found\n");
+    }
+
+    switch_safe_free(dup);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(amd_gateways_function)
+{
+    /* Syntax:
+     *   amd_gateways [<name>]
+     */
+    amd_rate_key_t *k;
+    uint32_t i;
+
+    (void)session;
+
+    if (!amd.rate_keys) {
+        stream->write_function(stream, "-ERR Gateway statistics disabled (rates_keys=0)\n");
+    } else if (zstr(cmd)) {
+        for (i = 0; i < amd.rates_keys; i++) {
+            k = &amd.rate_keys[i];
+            if (k->kind == 'g' && atomic_load_explicit(&k->ready, memory_order_acquire)) {
+                amd_gateway_print(stream, k);
+            }
+        }
+    } else if ((k = amd_rates_key('g', cmd, SWITCH_FALSE)) && atomic_load(&k->ready)) {
+        amd_gateway_print(stream, k);
+    } else {
+        stream->write_function(stream, "-ERR Not found\n");
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
 /* -------------------------
    Module load / shutdown
    ------------------------- */
@@ -552,13 +5718,47 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_amd_load)
     switch_application_interface_t *app_interface = NULL;
     switch_api_interface_t *api_interface = NULL;
 
+    switch_threadattr_t *thd_attr = NULL;
+
     *module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
+    amd.pool = pool;
+    switch_thread_rwlock_create(&amd.config_lock, pool);
+
     if (do_config(SWITCH_FALSE) != SWITCH_STATUS_SUCCESS) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_amd: configuration failed\n");
         return SWITCH_STATUS_FALSE;
     }
 
+    amd_bandit_restore();
+
+    amd_cache_init();
+    amd_cache_restore();
+
+    if (switch_event_reserve_subclass(AMD_EVENT_PROGRESS) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(AMD_EVENT_CORRECTION) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(AMD_EVENT_MONITOR) != SWITCH_STATUS_SUCCESS ||
+        switch_event_reserve_subclass(AMD_EVENT_STATS) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_amd: cannot reserve amd:: event subclasses\n");
+    }
+
+    if (switch_event_bind_removable(modname, SWITCH_EVENT_RELOADXML, NULL, amd_reload_event_handler, NULL,
+                                    &amd.reload_node) != SWITCH_STATUS_SUCCESS) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_amd: cannot bind reloadxml; config reload disabled\n");
+    }
+
+    atomic_store(&amd.running, 1);
+    switch_threadattr_create(&thd_attr, pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    switch_thread_create(&amd.housekeeping_thread, thd_attr, amd_housekeeping_run, NULL, pool);
+
+    amd_ext_init();
+    amd_audio_shm_init();
+    amd_capture_init();
+    amd_log_init();
+    amd_stats_init();
+    amd_rates_init();
+
     /* Dialplan app: amd */
     SWITCH_ADD_APP(app_interface,
                    "amd",
@@ -568,6 +5768,15 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_amd_load)
                    "[key=val;key=val...]",
                    SAF_NONE);
 
+    /* Dialplan app: amd_preroll */
+    SWITCH_ADD_APP(app_interface,
+                   "amd_preroll",
+                   "Capture recent audio for a later AMD start",
+                   "Keep the last N ms of inbound audio so AMD can analyse it retroactively",
+                   amd_preroll_function,
+                   "[ms]",
+                   SAF_NONE);
+
     /* API: uuid_amd_detect */
     SWITCH_ADD_API(api_interface,
                    "uuid_amd_detect",
@@ -575,8 +5784,39 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_amd_load)
                    uuid_amd_detect_function,
                    "<uuid> [key=val;key=val;...]");
 
+    /* API: amd_feedback */
+    SWITCH_ADD_API(api_interface,
+                   "amd_feedback",
+                   "Report verified AMD outcome for profile self-tuning",
+                   amd_feedback_function,
+                   "<profile> <correct|incorrect> <decision_ms>");
+
+    /* API: amd_cache */
+    SWITCH_ADD_API(api_interface,
+                   "amd_cache",
+                   "Destination result cache statistics and lookup",
+                   amd_cache_function,
+                   "stats|lookup <number>");
+
+    /* API: amd_rates */
+    SWITCH_ADD_API(api_interface,
+                   "amd_rates",
+                   "Recent AMD result rates per campaign and gateway",
+                   amd_rates_function,
+                   "[<campaign>|gateway <name>] [seconds]");
+
+    /* API: amd_gateways */
+    SWITCH_ADD_API(api_interface,
+                   "amd_gateways",
+                   "AMD audio quality per gateway",
+                   amd_gateways_function,
+                   "[<name>]");
+
     /* fs_cli tab-completion for UUIDs */
     switch_console_set_complete("add uuid_amd_detect ::console::list_uuid");
+    switch_console_set_complete("add amd_cache stats");
+    switch_console_set_complete("add amd_cache lookup");
+    switch_console_set_complete("add amd_rates gateway");
 
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_amd loaded\n");
     return SWITCH_STATUS_SUCCESS;
@@ -584,6 +5824,40 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_amd_load)
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_amd_shutdown)
 {
+    switch_status_t st;
+
+    switch_event_unbind(&amd.reload_node);
+    switch_event_free_subclass(AMD_EVENT_PROGRESS);
+    switch_event_free_subclass(AMD_EVENT_CORRECTION);
+    switch_event_free_subclass(AMD_EVENT_MONITOR);
+    switch_event_free_subclass(AMD_EVENT_STATS);
+
+    atomic_store(&amd.running, 0);
+    if (amd.housekeeping_thread) {
+        switch_thread_join(&st, amd.housekeeping_thread);
+    }
+    if (amd.classifier_thread) {
+        switch_thread_join(&st, amd.classifier_thread);
+    }
+    if (amd.capture_thread) {
+        switch_thread_join(&st, amd.capture_thread);
+    }
+    if (amd.log_thread) {
+        switch_thread_join(&st, amd.log_thread);
+    }
+    if (amd.stats_thread) {
+        switch_thread_join(&st, amd.stats_thread);
+    }
+
+    amd_bandit_save();
+    amd_cache_save();
+    amd_cache_shutdown();
+    amd_audio_shm_shutdown();
+
+    if (amd.config) {
+        switch_core_destroy_memory_pool(&amd.config->pool);
+    }
+
     switch_xml_config_cleanup(instructions);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_amd shutdown\n");
     return SWITCH_STATUS_SUCCESS;
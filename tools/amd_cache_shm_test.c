@@ -0,0 +1,188 @@
+/*
+ * amd_cache_shm_test.c
+ *
+ * Multi-process check of the shared-memory result cache (cache_shm_name).
+ * Builds mod_amd.c into the test so it exercises the real segment code:
+ *   1. a late creator: one process opens the segment before it is sized
+ *      and must wait for it instead of falling back to a private cache;
+ *   2. N processes attach at the same instant, exactly one creates;
+ *   3. each process stores its own destinations, then reads everybody
+ *      else's; every hit must carry the value its writer stored.
+ *
+ * Usage:
+ *   amd_cache_shm_test [processes] [keys_per_process]
+ *
+ * Exits non-zero on the first failed check. Built by `make -f Makefile.sample check`.
+ */
+
+#include "../mod_amd.c"
+
+#include <sys/wait.h>
+
+#define TEST_SHM_NAME "/mod_amd_cache_test"
+#define TEST_ENTRIES (65536)
+
+static int fail(const char *what)
+{
+    fprintf(stderr, "FAIL: %s\n", what);
+    return 1;
+}
+
+static void test_attach(void)
+{
+    amd.cache_shm = NULL;
+    amd.cache_shm_created = SWITCH_FALSE;
+    amd.cache_entries = TEST_ENTRIES;
+    amd.cache_ttl = 3600;
+    amd.cache_shm_name = TEST_SHM_NAME;
+}
+
+static void test_key(char *key, size_t len, int proc, int n)
+{
+    snprintf(key, len, "9%02d%07d", proc, n);
+}
+
+/* Open the segment first and size it only after an attacher is already waiting */
+static int test_late_creator(void)
+{
+    int fd, status;
+    pid_t pid;
+    amd_shm_cache_t *shm;
+    switch_size_t size = sizeof(amd_shm_cache_t) + (switch_size_t)TEST_ENTRIES * sizeof(amd_shm_slot_t);
+
+    shm_unlink(TEST_SHM_NAME);
+    if ((fd = shm_open(TEST_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        return fail("late creator: shm_open");
+    }
+
+    if (!(pid = fork())) {
+        test_attach();
+        _exit(amd_cache_shm_init() == SWITCH_STATUS_SUCCESS && !amd.cache_shm_created ? 0 : 1);
+    }
+
+    usleep(200000);
+    if (ftruncate(fd, (off_t)size) ||
+        (shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        return fail("late creator: size segment");
+    }
+    close(fd);
+    shm->version = 1;
+    shm->slot_size = sizeof(amd_shm_slot_t);
+    shm->slots = TEST_ENTRIES;
+    atomic_store_explicit(&shm->ready, AMD_CACHE_MAGIC, memory_order_release);
+
+    waitpid(pid, &status, 0);
+    munmap(shm, size);
+    shm_unlink(TEST_SHM_NAME);
+
+    return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : fail("late creator: attacher did not share the segment");
+}
+
+static int test_child(int proc, int procs, int keys, int start_fd, int stored_fd, int read_fd)
+{
+    char key[32], c;
+    int p, n, hits = 0, wrong = 0, total = 0;
+    amd_cache_entry_t e;
+
+    if (read(start_fd, &c, 1) < 0) {
+        return 2;
+    }
+
+    test_attach();
+    if (amd_cache_shm_init() != SWITCH_STATUS_SUCCESS) {
+        return 2;
+    }
+
+    for (n = 0; n < keys; n++) {
+        test_key(key, sizeof(key), proc, n);
+        amd_cache_store(key, (n & 1) ? "MACHINE" : "HUMAN", (n & 1) ? "MAXWORDS" : "INITIALSILENCE");
+    }
+
+    /* Tell the parent we are done storing, then wait until everybody is */
+    if (write(stored_fd, amd.cache_shm_created ? "C" : "A", 1) != 1 || read(read_fd, &c, 1) < 0) {
+        return 2;
+    }
+
+    for (p = 0; p < procs; p++) {
+        for (n = 0; n < keys; n++) {
+            test_key(key, sizeof(key), p, n);
+            total++;
+            if (!amd_cache_lookup(key, &e)) {
+                continue;
+            }
+            hits++;
+            if (strcmp(e.key, key) || strcmp(e.result, (n & 1) ? "MACHINE" : "HUMAN") ||
+                strcmp(e.cause, (n & 1) ? "MAXWORDS" : "INITIALSILENCE")) {
+                wrong++;
+            }
+        }
+    }
+
+    printf("process %d: %d/%d hits, %d wrong\n", proc, hits, total, wrong);
+    fflush(stdout);
+    amd_cache_shutdown();
+
+    /* Probing only ever evicts a handful at this load; anything more means the processes were not sharing */
+    return wrong || hits < total - total / 100 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int procs = argc > 1 ? atoi(argv[1]) : 8;
+    int keys = argc > 2 ? atoi(argv[2]) : 2000;
+    int start[2], stored[2], done[2], p, status, created = 0, failed = 0;
+    char c;
+
+    if (procs < 2 || procs > 99 || keys < 1 || procs * keys > TEST_ENTRIES / 2) {
+        fprintf(stderr, "usage: %s [processes 2-99] [keys_per_process], at most %d keys in total\n", argv[0], TEST_ENTRIES / 2);
+        return 2;
+    }
+
+    if (test_late_creator()) {
+        return 1;
+    }
+    printf("late creator: ok\n");
+    fflush(stdout);
+
+    shm_unlink(TEST_SHM_NAME);
+    if (pipe(start) || pipe(stored) || pipe(done)) {
+        return fail("pipe");
+    }
+
+    for (p = 0; p < procs; p++) {
+        if (!fork()) {
+            close(start[1]);
+            close(done[1]);
+            _exit(test_child(p, procs, keys, start[0], stored[1], done[0]));
+        }
+    }
+
+    /* Closing the start pipe releases every child at once */
+    close(stored[1]);
+    close(start[1]);
+    for (p = 0; p < procs; p++) {
+        if (read(stored[0], &c, 1) != 1) {
+            break;
+        }
+        created += c == 'C';
+    }
+    close(done[1]);
+
+    for (p = 0; p < procs; p++) {
+        wait(&status);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    shm_unlink(TEST_SHM_NAME);
+
+    if (created != 1) {
+        fprintf(stderr, "FAIL: %d processes created the segment, expected 1\n", created);
+        return 1;
+    }
+    if (failed) {
+        fprintf(stderr, "FAIL: %d of %d processes\n", failed, procs);
+        return 1;
+    }
+
+    printf("%d processes x %d keys: ok\n", procs, keys);
+    return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * amd_classifier_stub.c
+ *
+ * Reference stand-in for an external mod_amd classifier (classifier_endpoint).
+ * Speaks the framed protocol described in mod_amd.c / README.md and answers
+ * each call once it has seen enough audio, using a plain energy rule:
+ *   - mostly voiced audio  -> MACHINE STUB
+ *   - otherwise            -> HUMAN STUB
+ *
+ * Usage:
+ *   amd_classifier_stub <unix:/path|tcp:port> [decide_after_ms] [silence_threshold] [reply_delay_ms]
+ *
+ * Not meant for production; it exists to exercise the module end to end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_CLIENTS (64)
+#define MAX_CALLS (4096)
+#define RBUF_SIZE (256 * 1024)
+
+#define MSG_START (1)
+#define MSG_AUDIO (2)
+#define MSG_STOP (3)
+#define MSG_VERDICT (16)
+
+typedef struct {
+    uint32_t call_id;
+    uint32_t rate;
+    uint64_t samples;
+    uint64_t voiced;
+    int answered;
+} call_t;
+
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+} client_t;
+
+static call_t calls[MAX_CALLS];
+static uint32_t decide_after_ms = 800;
+static uint32_t silence_threshold = 256;
+static uint32_t reply_delay_ms = 0;
+
+static call_t *call_get(uint32_t call_id, int create)
+{
+    call_t *call = &calls[call_id % MAX_CALLS];
+
+    if (call->call_id != call_id) {
+        if (!create) {
+            return NULL;
+        }
+        memset(call, 0, sizeof(*call));
+        call->call_id = call_id;
+    }
+
+    return call;
+}
+
+static void send_verdict(int fd, uint32_t call_id, const char *text)
+{
+    uint8_t out[64];
+    uint32_t len = (uint32_t)strlen(text), v;
+    uint16_t type = htons(MSG_VERDICT), zero = 0;
+
+    v = htonl(len);
+    memcpy(out, &v, 4);
+    memcpy(out + 4, &type, 2);
+    memcpy(out + 6, &zero, 2);
+    v = htonl(call_id);
+    memcpy(out + 8, &v, 4);
+    memcpy(out + 12, text, len);
+
+    if (reply_delay_ms) {
+        usleep(reply_delay_ms * 1000);
+    }
+
+    if (send(fd, out, 12 + len, MSG_NOSIGNAL) < 0) {
+        perror("send");
+    }
+}
+
+static void handle_audio(int fd, call_t *call, const int16_t *pcm, size_t samples)
+{
+    size_t i, frame = call->rate ? call->rate / 50 : 160;
+
+    /* Score 20 ms frames the same way the built-in classifier does */
+    for (i = 0; i < samples; i += frame) {
+        size_t j, n = samples - i < frame ? samples - i : frame;
+        uint64_t energy = 0;
+
+        for (j = 0; j < n; j++) {
+            energy += (uint64_t)abs(pcm[i + j]);
+        }
+        if (n && energy / n >= silence_threshold) {
+            call->voiced += n;
+        }
+        call->samples += n;
+    }
+
+    if (!call->answered && call->rate && call->samples * 1000 / call->rate >= decide_after_ms) {
+        const char *verdict = call->voiced * 10 >= call->samples * 6 ? "MACHINE STUB" : "HUMAN STUB";
+
+        printf("call %u: %s after %llu ms (voiced %llu%%)\n", call->call_id, verdict,
+               (unsigned long long)(call->samples * 1000 / call->rate),
+               (unsigned long long)(call->voiced * 100 / call->samples));
+        send_verdict(fd, call->call_id, verdict);
+        call->answered = 1;
+    }
+}
+
+/* Process complete messages; returns bytes consumed */
+static size_t handle_input(int fd, uint8_t *buf, size_t len)
+{
+    size_t used = 0;
+
+    while (len - used >= 12) {
+        uint32_t plen, call_id;
+        uint16_t type;
+        uint8_t *payload = buf + used + 12;
+        call_t *call;
+
+        memcpy(&plen, buf + used, 4);
+        memcpy(&type, buf + used + 4, 2);
+        memcpy(&call_id, buf + used + 8, 4);
+        plen = ntohl(plen);
+        type = ntohs(type);
+        call_id = ntohl(call_id);
+
+        if (len - used < 12 + (size_t)plen) {
+            break;
+        }
+
+        switch (type) {
+        case MSG_START:
+            if (plen >= 4 && (call = call_get(call_id, 1))) {
+                uint32_t rate;
+
+                memcpy(&rate, payload, 4);
+                call->rate = ntohl(rate);
+                printf("call %u: start %.*s @ %u Hz\n", call_id, (int)(plen - 4), (const char *)payload + 4, call->rate);
+            }
+            break;
+        case MSG_AUDIO:
+            if ((call = call_get(call_id, 0))) {
+                handle_audio(fd, call, (const int16_t *)payload, plen / sizeof(int16_t));
+            }
+            break;
+        case MSG_STOP:
+            if ((call = call_get(call_id, 0))) {
+                printf("call %u: stop\n", call_id);
+                call->call_id = 0;
+            }
+            break;
+        default:
+            break;
+        }
+
+        used += 12 + plen;
+    }
+
+    return used;
+}
+
+static int listen_on(const char *endpoint)
+{
+    int fd = -1, one = 1;
+
+    if (!strncasecmp(endpoint, "unix:", 5)) {
+        struct sockaddr_un sun = { 0 };
+
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, endpoint + 5, sizeof(sun.sun_path) - 1);
+        unlink(sun.sun_path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+            return -1;
+        }
+    } else if (!strncasecmp(endpoint, "tcp:", 4)) {
+        struct sockaddr_in sin = { 0 };
+        const char *port = strrchr(endpoint, ':') + 1;
+
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons((uint16_t)atoi(port));
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+            return -1;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return listen(fd, 16) ? -1 : fd;
+}
+
+int main(int argc, char **argv)
+{
+    client_t clients[MAX_CLIENTS];
+    int lfd, i, nclients = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <unix:/path|tcp:port> [decide_after_ms] [silence_threshold] [reply_delay_ms]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) decide_after_ms = (uint32_t)atoi(argv[2]);
+    if (argc > 3) silence_threshold = (uint32_t)atoi(argv[3]);
+    if (argc > 4) reply_delay_ms = (uint32_t)atoi(argv[4]);
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if ((lfd = listen_on(argv[1])) < 0) {
+        perror("listen");
+        return 1;
+    }
+    printf("listening on %s (decide after %u ms, threshold %u)\n", argv[1], decide_after_ms, silence_threshold);
+
+    for (;;) {
+        struct pollfd pfd[MAX_CLIENTS + 1];
+
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            pfd[i + 1].fd = clients[i].fd;
+            pfd[i + 1].events = POLLIN;
+        }
+
+        if (poll(pfd, (nfds_t)nclients + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+
+        for (i = nclients - 1; i >= 0; i--) {
+            client_t *c = &clients[i];
+            ssize_t n;
+
+            if (!(pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            n = recv(c->fd, c->buf + c->len, RBUF_SIZE - c->len, 0);
+            if (n <= 0) {
+                printf("client %d closed\n", c->fd);
+                close(c->fd);
+                free(c->buf);
+                clients[i] = clients[--nclients];
+                continue;
+            }
+
+            c->len += (size_t)n;
+            n = (ssize_t)handle_input(c->fd, c->buf, c->len);
+            memmove(c->buf, c->buf + n, c->len - (size_t)n);
+            c->len -= (size_t)n;
+        }
+
+        if ((pfd[0].revents & POLLIN) && nclients < MAX_CLIENTS) {
+            int fd = accept(lfd, NULL, NULL);
+
+            if (fd >= 0) {
+                clients[nclients].fd = fd;
+                clients[nclients].buf = malloc(RBUF_SIZE);
+                clients[nclients].len = 0;
+                nclients++;
+                printf("client %d connected\n", fd);
+            }
+        }
+    }
+
+    return 0;
+}